@@ -117,6 +117,23 @@ int tfsPrint(char* path) {
   return *result;
 }
 
+int tfsPrintSubtree(char* path, char* subtree) {
+
+  sprintf(command, "p %s %s", path, subtree);
+
+  if (sendto(sockfd, command, strlen(command)+1, 0, (struct sockaddr *) &servAddr, servlen) < 0) {
+    perror("client: print sendto error");
+    return -1;
+  }
+
+  if(recvfrom(sockfd, result, sizeof(result)-1, 0, 0, 0) < 0) {
+    perror("client: print receive error");
+    return -1;
+  }
+
+  return *result;
+}
+
 int tfsMount(char * sockPath) {
 
   command = malloc(sizeof(char)*MAX_INPUT_SIZE*2); /* Inits command */
@@ -8,6 +8,7 @@ int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char* path);
+int tfsPrintSubtree(char* path, char* subtree);
 int tfsMount(char* serverName);
 int tfsUnmount();
 
@@ -101,9 +101,9 @@ void *processInput() {
                   printf("Unable to move: %s to %s\n", arg1, arg2);
                 break;
             case 'p':
-                if(numTokens != 2)
+                if(numTokens != 2 && numTokens != 3)
                     errorParse();
-                res = tfsPrint(arg1);
+                res = numTokens == 2 ? tfsPrint(arg1) : tfsPrintSubtree(arg1, arg2);
                 if (!res)
                   printf("Successfully printed to %s\n", arg1);
                 else
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "../fs/state.h"
+
+/*
+ * Times the i-node locks of neighbouring i-nodes taken by different threads,
+ * as lookups and creates in sibling directories do: every thread takes and
+ * releases a lock of its own, next to the others in an array. With the
+ * locks packed, neighbours share cache lines, and every acquire that
+ * writes the lock invalidates them for the others; padded as inodeLock
+ * is, each has lines of its own. Reads only write the lock until it is
+ * reader biased, so the mixed mode writes one time in WRITE_RATIO to keep
+ * it from staying biased. Prints millions of acquires per second.
+ * Usage: bench/falseshare [acquires per thread]
+ */
+
+#define ACQUIRES 2000000
+#define WRITE_RATIO 16
+#define MAX_THREADS 8
+
+/* The members of inodeLock, without the padding */
+typedef struct packedLock {
+    rwLock lock;
+    intentLock intent;
+} packedLock;
+
+typedef struct {
+    rwLock *lock;
+    int mode;
+} lockThreadArgs;
+
+enum { MODE_READ, MODE_MIXED, MODE_WRITE };
+static const char *modes[] = { "read", "mixed", "write" };
+static const int threads[] = { 1, 2, 4, 8 };
+
+static int acquires;
+static pthread_barrier_t start;
+
+
+static double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+
+static void *lock_thread(void *arg) {
+    lockThreadArgs *args = arg;
+
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < acquires; i++) {
+        if (args->mode == MODE_WRITE || (args->mode == MODE_MIXED && i % WRITE_RATIO == 0))
+            lockwr(args->lock);
+        else
+            lockrd(args->lock);
+        unlock(args->lock);
+    }
+    return NULL;
+}
+
+
+/*
+ * Runs n threads, the i-th on the lock at base + i * stride.
+ * Returns: millions of acquires per second
+ */
+static double run(char *base, size_t stride, int n, int mode) {
+    pthread_t tids[MAX_THREADS];
+    lockThreadArgs args[MAX_THREADS];
+
+    for (int i = 0; i < n; i++)
+        lockInit((rwLock *) (base + i * stride), LOCK_DEFAULT_FLAGS);
+    pthread_barrier_init(&start, NULL, n + 1);
+    for (int i = 0; i < n; i++) {
+        args[i].lock = (rwLock *) (base + i * stride);
+        args[i].mode = mode;
+        if (pthread_create(&tids[i], NULL, lock_thread, &args[i]) != 0) {
+            fprintf(stderr, "Error: couldn't create lock thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double t0 = now_ns();
+    for (int i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = now_ns() - t0;
+
+    pthread_barrier_destroy(&start);
+    for (int i = 0; i < n; i++)
+        lockDestroy((rwLock *) (base + i * stride));
+    return n * (double) acquires * 1e3 / elapsed;
+}
+
+
+int main(int argc, char *argv[]) {
+    char *base;
+
+    acquires = argc > 1 ? atoi(argv[1]) : ACQUIRES;
+    if (acquires <= 0) {
+        fprintf(stderr, "Usage: %s [acquires per thread]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (posix_memalign((void **) &base, CACHE_LINE_SIZE, sizeof(inodeLock) * MAX_THREADS) != 0) {
+        fprintf(stderr, "Error: couldn't allocate locks.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-16s", "falseshare");
+    for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+        printf("%10d", threads[t]);
+    printf("\n");
+    for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (int padded = 0; padded <= 1; padded++) {
+            size_t stride = padded ? sizeof(inodeLock) : sizeof(packedLock);
+            printf("%-6s %-9s", modes[m], padded ? "padded" : "packed");
+            for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+                printf("%10.1f", run(base, stride, threads[t], m));
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+
+    free(base);
+    exit(EXIT_SUCCESS);
+}
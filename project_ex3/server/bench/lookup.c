@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../fs/operations.h"
+#include "../fs/sync.h"
+
+/*
+ * Times lookups alone, in the server's own code but without the socket in
+ * between: a tree of FANOUT^3 files is built once, and then every thread
+ * looks up random paths in it, one in LOOKUP_MISS_RATIO of them missing.
+ * Prints the lookups per second of every strategy and thread count.
+ * Usage: bench/lookup [lookups per thread]
+ */
+
+#define FANOUT 8
+#define LOOKUP_MISS_RATIO 8
+#define LOOKUPS 200000
+
+static const char *strategies[] = { "nosync", "mutex", "rwlock", "inode", "coupling", "optimistic" };
+static const int threads[] = { 1, 4, 16, 64 };
+
+static int lookups;
+static pthread_barrier_t start;
+
+
+static double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+
+static void build_tree() {
+    char path[32];
+
+    for (int a = 0; a < FANOUT; a++) {
+        snprintf(path, sizeof(path), "/a%d", a);
+        create(path, T_DIRECTORY);
+        for (int b = 0; b < FANOUT; b++) {
+            snprintf(path, sizeof(path), "/a%d/b%d", a, b);
+            create(path, T_DIRECTORY);
+            for (int c = 0; c < FANOUT; c++) {
+                snprintf(path, sizeof(path), "/a%d/b%d/c%d", a, b, c);
+                create(path, T_FILE);
+            }
+        }
+    }
+}
+
+
+/* Looks up random paths of the tree, the seed given as argument */
+static void *lookup_thread(void *arg) {
+    unsigned int seed = (unsigned int) (long) arg;
+    char path[32];
+    long found = 0;
+
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < lookups; i++) {
+        int r = rand_r(&seed);
+        snprintf(path, sizeof(path), "/a%d/b%d/%c%d", r % FANOUT, r / FANOUT % FANOUT,
+                 r / (FANOUT * FANOUT) % LOOKUP_MISS_RATIO == 0 ? 'x' : 'c', r / (FANOUT * FANOUT * LOOKUP_MISS_RATIO) % FANOUT);
+        found += lookup_unlocked(path) >= 0;
+    }
+    return (void *) found;
+}
+
+
+/* Runs n threads at once, returns the lookups per second */
+static long run(int n) {
+    pthread_t *tids = malloc(sizeof(pthread_t) * n);
+
+    pthread_barrier_init(&start, NULL, n + 1);
+    for (long i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, lookup_thread, (void *) (i + 1)) != 0) {
+            fprintf(stderr, "Error: couldn't create lookup thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double t0 = now_ns();
+    for (int i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = now_ns() - t0;
+
+    pthread_barrier_destroy(&start);
+    free(tids);
+    return (long) (n * (double) lookups * 1e9 / elapsed);
+}
+
+
+int main(int argc, char *argv[]) {
+    lookups = argc > 1 ? atoi(argv[1]) : LOOKUPS;
+    if (lookups <= 0) {
+        fprintf(stderr, "Usage: %s [lookups per thread]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    sync_init("nosync");
+    init_fs();
+    build_tree();
+    sync_destroy();
+
+    printf("%-12s", "lookup");
+    for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+        printf("%10d", threads[t]);
+    printf("\n");
+    for (int s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+        sync_init(strategies[s]);
+        printf("%-12s", strategies[s]);
+        for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            if (!sync_multithreaded() && threads[t] != 1) {
+                printf("%10s", "-");
+                continue;
+            }
+            printf("%10ld", run(threads[t]));
+            fflush(stdout);
+        }
+        printf("\n");
+        sync_destroy();
+    }
+
+    destroy_fs();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../fs/operations.h"
+#include "../fs/sync.h"
+
+/*
+ * Times how long a writer on the root waits for the operations deep in the
+ * tree: some threads create and delete files under /deep/a/b/c while one
+ * more creates and deletes a file of the root, whose write lock it must
+ * get past them. The longer the deep operations hold the root, the longer
+ * each of its operations takes. Prints the microseconds of a root create
+ * and delete for every strategy and number of deep threads.
+ * Usage: bench/rootlock [root operations]
+ */
+
+#define DEEP_PATH "/deep/a/b/c"
+#define ROOT_OPS 200
+
+static const char *strategies[] = { "mutex", "rwlock", "inode", "coupling", "optimistic" };
+static const int threads[] = { 0, 1, 4, 16 };
+
+static int root_ops;
+static int stop;
+
+
+static double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+
+/* Creates and deletes a file of its own under DEEP_PATH until stopped */
+static void *deep_thread(void *arg) {
+    char path[32];
+
+    snprintf(path, sizeof(path), DEEP_PATH "/t%ld", (long) arg);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        create(path, T_FILE);
+        delete(path);
+    }
+    return NULL;
+}
+
+
+/* Runs n deep threads and times the root operations meanwhile, in microseconds */
+static double run(int n) {
+    pthread_t *tids = malloc(sizeof(pthread_t) * n);
+    char root_file[] = "/r";
+
+    stop = 0;
+    for (long i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, deep_thread, (void *) i) != 0) {
+            fprintf(stderr, "Error: couldn't create deep thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double t0 = now_ns();
+    for (int i = 0; i < root_ops; i++) {
+        create(root_file, T_FILE);
+        delete(root_file);
+    }
+    double elapsed = now_ns() - t0;
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return elapsed / root_ops / 1e3;
+}
+
+
+int main(int argc, char *argv[]) {
+    root_ops = argc > 1 ? atoi(argv[1]) : ROOT_OPS;
+    if (root_ops <= 0) {
+        fprintf(stderr, "Usage: %s [root operations]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char path[] = DEEP_PATH;
+    sync_init("nosync");
+    init_fs();
+    /* creates each prefix of the path in turn */
+    for (char *c = path + 1; ; c++) {
+        if (*c == '/' || *c == '\0') {
+            char end = *c;
+            *c = '\0';
+            create(path, T_DIRECTORY);
+            if ((*c = end) == '\0')
+                break;
+        }
+    }
+    sync_destroy();
+
+    printf("%-12s", "rootlock");
+    for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+        printf("%10d", threads[t]);
+    printf("\n");
+    for (int s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+        sync_init(strategies[s]);
+        printf("%-12s", strategies[s]);
+        for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            printf("%10.1f", run(threads[t]));
+            fflush(stdout);
+        }
+        printf("\n");
+        sync_destroy();
+    }
+
+    destroy_fs();
+    exit(EXIT_SUCCESS);
+}
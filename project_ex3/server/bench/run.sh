@@ -0,0 +1,135 @@
+#!/bin/bash
+# Runs the server on a workload under every synchronization strategy and
+# number of worker threads, and prints the throughput of each run in
+# operations per second. Build first with: make bench
+#
+# Usage: bench/run.sh [scenario | inputdir]
+# A scenario is generated by bench/workload. An input directory holds
+# client input files of one's own: every client*.txt in it is run by a
+# client of its own, after setup.txt if there is one.
+# With a background.txt, every run is repeated with a client running it
+# alongside the others, untimed, on the rows marked +bg.
+# The environment can override:
+#   THREADS     worker thread counts (default "1 4 16 64")
+#   STRATEGIES  strategies (default all of them), "default" to pass none
+#   SERVER      absolute path of another server binary to compare against
+#   CLIENTS     client processes sending at once (default 64)
+#   OPS         operations sent by each client (default 500)
+#   TIMEOUT     seconds a client may run before its run is shown as hang,
+#               for the stress scenarios (default 120)
+
+scenario=${1:-mixed}
+[ -d "$scenario" ] && inputdir=$(cd "$scenario" && pwd)
+threads=${THREADS:-1 4 16 64}
+strategies=${STRATEGIES:-nosync mutex rwlock inode coupling optimistic}
+clients=${CLIENTS:-64}
+ops=${OPS:-500}
+timeout=${TIMEOUT:-120}
+
+cd "$(dirname "$0")/.."
+server=${SERVER:-./tecnicofs}
+client=../client/tecnicofs-client
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+if [ ! -x "$server" ] || [ ! -x "$client" ] || [ ! -x bench/workload ];
+    then
+        echo Run make bench first.
+        exit 1
+fi
+
+if [ -n "$inputdir" ];
+    then
+        cp "$inputdir"/client*.txt "$work" || exit 1
+        [ -f "$inputdir/setup.txt" ] && cp "$inputdir/setup.txt" "$work"
+        [ -f "$inputdir/background.txt" ] && cp "$inputdir/background.txt" "$work"
+    else
+        bench/workload "$scenario" "$clients" "$ops" "$work" || exit 1
+fi
+total=$(cat "$work"/client*.txt | grep -c "^[cldmp] ")
+
+now() {
+    date +%s%N
+}
+
+# Starts the server with $1 threads and strategy $2, and waits for its socket
+start_server() {
+    local strategy=$2
+    [ "$strategy" = default ] && strategy=
+    sock=$work/server.sock
+    rm -f "$sock"
+    "$server" "$1" "$sock" $strategy > /dev/null 2> "$work/server.err" &
+    pid=$!
+    for i in $(seq 1 50)
+    do
+        [ -S "$sock" ] && return 0
+        kill -0 $pid 2> /dev/null || return 1
+        sleep 0.1
+    done
+    return 1
+}
+
+stop_server() {
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+}
+
+# Runs every client file at once and prints the operations per second,
+# in a subshell of its own, so the wait is for the clients alone. With $1
+# set, background.txt runs meanwhile, and is stopped once they are done.
+# Prints hang if a client is still waiting for the server after $timeout.
+run_clients() {
+    local pids=() background hung
+    if [ -n "$1" ];
+        then
+            "$client" "$work/background.txt" "$sock" > /dev/null &
+            background=$!
+    fi
+    local start=$(now)
+    for input in "$work"/client*.txt
+    do
+        timeout "$timeout" "$client" "$input" "$sock" > /dev/null &
+        pids+=($!)
+    done
+    for p in "${pids[@]}"
+    do
+        wait $p
+        [ $? = 124 ] && hung=1
+    done
+    local ns=$(( $(now) - start ))
+    if [ -n "$background" ];
+        then
+            kill $background
+            wait $background 2> /dev/null
+            rm -f "/tmp/Client$background"
+    fi
+    [ -n "$hung" ] && echo hang || echo $(( total * 1000000000 / ns ))
+}
+
+rows=plain
+[ -f "$work/background.txt" ] && rows="plain background"
+
+printf "%-14s" "$(basename "$scenario")"
+for t in $threads; do printf "%10s" "$t"; done
+echo
+for strategy in $strategies
+do
+    for row in $rows
+    do
+        [ $row = plain ] && printf "%-14s" "$strategy" || printf "%-14s" "$strategy+bg"
+        for t in $threads
+        do
+            if ! start_server "$t" "$strategy";
+                then
+                    # nosync only runs with one thread
+                    stop_server
+                    printf "%10s" "-"
+                    continue
+            fi
+            [ -f "$work/setup.txt" ] && "$client" "$work/setup.txt" "$sock" > /dev/null
+            printf "%10s" "$(run_clients $([ $row = background ] && echo 1))"
+            stop_server
+        done
+        echo
+    done
+done
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../fs/state.h"
+#include "../fs/dir.h"
+#include "../fs/tags.h"
+
+/*
+ * Times directory_lookup on directories of 8, 64, 1k and 100k entries,
+ * with the tag kernel tags_init chose and with one that compares a tag at
+ * a time, for what the SIMD kernels save. Lookups are of random names
+ * that all exist. Prints the best ns per lookup of a few rounds.
+ * Usage: bench/tags
+ */
+
+#define NAMES_MASK ((1 << 20) - 1) /* random names drawn, less one */
+#define LOOKUPS (1 << 22)
+#define ROUNDS 5
+
+static const int sizes[] = { 8, 64, 1000, 100000 };
+static const char *kinds[] = { "inline", "hash", "btree", "concurrent", "global" };
+
+
+/* Compares the tags one at a time */
+static unsigned int match_loop(const unsigned short *tags, unsigned short tag, unsigned int *free) {
+    unsigned int match = 0, empty = 0;
+
+    for (int i = 0; i < TAG_GROUP; i++) {
+        match |= (unsigned int) (tags[i] == tag) << i;
+        empty |= (unsigned int) (tags[i] == TAG_FREE) << i;
+    }
+    *free = empty;
+    return match;
+}
+
+
+static double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+
+/* Returns the best ns per lookup of ROUNDS rounds of LOOKUPS lookups */
+static double time_lookups(Directory *dir, char (*names)[MAX_FILE_NAME], int *lens, unsigned int *hashes, int *order) {
+    double best = 0;
+    long found = 0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        double t0 = now_ns();
+        for (long i = 0; i < LOOKUPS; i++) {
+            int k = order[i & NAMES_MASK];
+            found += directory_lookup(dir, names[k], lens[k], hashes[k]) != FAIL;
+        }
+        double t = (now_ns() - t0) / LOOKUPS;
+        if (round == 0 || t < best)
+            best = t;
+    }
+    if (found != (long) ROUNDS * LOOKUPS) {
+        fprintf(stderr, "Error: %ld of %ld names found.\n", found, (long) ROUNDS * LOOKUPS);
+        exit(EXIT_FAILURE);
+    }
+    return best;
+}
+
+
+int main() {
+    inode_table_init();
+    unsigned int (*selected)(const unsigned short *, unsigned short, unsigned int *) = tags_match;
+
+    printf("%-8s %-10s %10s %10s\n", "entries", "kind", tags_kernel(), "loop");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        char (*names)[MAX_FILE_NAME] = malloc(sizeof(*names) * n);
+        unsigned int *hashes = malloc(sizeof(unsigned int) * n);
+        int *lens = malloc(sizeof(int) * n);
+        int *order = malloc(sizeof(int) * (NAMES_MASK + 1));
+        Directory *dir = directory_new(FS_ROOT + 1);
+        unsigned int seed = 1;
+
+        for (int i = 0; i < n; i++) {
+            lens[i] = snprintf(names[i], MAX_FILE_NAME, "file_%07d", i * 7919 % 10000000);
+            hashes[i] = name_hash(names[i]);
+            directory_insert(dir, names[i], lens[i], hashes[i], i + 2);
+        }
+        for (int i = 0; i <= NAMES_MASK; i++)
+            order[i] = rand_r(&seed) % n;
+
+        tags_match = selected;
+        double simd = time_lookups(dir, names, lens, hashes, order);
+        tags_match = match_loop;
+        double loop = time_lookups(dir, names, lens, hashes, order);
+        printf("%-8d %-10s %10.1f %10.1f\n", n, kinds[dir->kind], simd, loop);
+        fflush(stdout);
+
+        directory_free(dir);
+        free(names);
+        free(hashes);
+        free(lens);
+        free(order);
+    }
+    tags_match = selected;
+
+    inode_table_destroy();
+    exit(EXIT_SUCCESS);
+}
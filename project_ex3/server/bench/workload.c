@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Writes client input files for bench/run.sh: setup.txt, run by one client
+ * before the others start, one client<i>.txt per client and, for some
+ * scenarios, background.txt, run alongside the clients but not timed. The
+ * same arguments always write the same files.
+ */
+
+#define NAME_SIZE 64
+/* Entries of /shared, looked up by every client */
+#define SHARED_FILES 16
+/* /big has BIG_FANOUT directories of BIG_FANOUT files, for prints to walk */
+#define BIG_FANOUT 64
+/* More prints than the clients can outlast */
+#define BACKGROUND_PRINTS 100000
+
+/* Entries a client has created and not yet deleted */
+typedef struct {
+    char (*names)[NAME_SIZE];
+    int count;
+} liveSet;
+
+
+/* xorshift, so every client gets its own reproducible sequence */
+static unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+static FILE *open_file(const char *dir, const char *name, const char *mode) {
+    char path[NAME_SIZE * 4];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, mode);
+    if (fp == NULL) {
+        fprintf(stderr, "Error: couldn't create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+
+/*
+ * Mixed workload: every client works in a directory of its own, so
+ * operations of different clients only meet on the root and /shared.
+ * Four in ten operations are lookups, of /shared or of the client's own
+ * entries, three create, two delete and one renames.
+ * Input:
+ *  - dir: directory the files are written to
+ *  - clients: number of client files
+ *  - ops: operations in each client file
+ */
+static void write_mixed(const char *dir, int clients, int ops) {
+    char name[NAME_SIZE];
+    FILE *fp = open_file(dir, "setup.txt", "w");
+
+    fprintf(fp, "c /shared d\n");
+    for (int k = 0; k < SHARED_FILES; k++)
+        fprintf(fp, "c /shared/s%d f\n", k);
+    for (int i = 0; i < clients; i++)
+        fprintf(fp, "c /c%d d\n", i);
+    fclose(fp);
+
+    liveSet live = { malloc(sizeof(*live.names) * ops), 0 };
+    for (int i = 0; i < clients; i++) {
+        unsigned int state = 2654435761U * (i + 1);
+        int created = 0;
+
+        snprintf(name, sizeof(name), "client%d.txt", i);
+        fp = open_file(dir, name, "w");
+        live.count = 0;
+        for (int n = 0; n < ops; n++) {
+            unsigned int r = next_random(&state) % 10;
+
+            if (r < 4 && (r < 2 || live.count == 0)) {
+                fprintf(fp, "l /shared/s%u\n", next_random(&state) % SHARED_FILES);
+            } else if (r < 4) {
+                fprintf(fp, "l %s\n", live.names[next_random(&state) % live.count]);
+            } else if (r < 7 || live.count == 0) {
+                snprintf(live.names[live.count], NAME_SIZE, "/c%d/e%d", i, created++);
+                fprintf(fp, "c %s %c\n", live.names[live.count++], r == 6 ? 'd' : 'f');
+            } else if (r < 9) {
+                fprintf(fp, "d %s\n", live.names[0]);
+                memmove(live.names, live.names + 1, sizeof(*live.names) * --live.count);
+            } else {
+                int k = next_random(&state) % live.count;
+                snprintf(name, sizeof(name), "/c%d/e%d", i, created++);
+                fprintf(fp, "m %s %s\n", live.names[k], name);
+                strcpy(live.names[k], name);
+            }
+        }
+        fclose(fp);
+    }
+    free(live.names);
+}
+
+
+/*
+ * Print workload: the mixed workload, with a large tree under /big and,
+ * in the background, a client that prints the whole tree over and over,
+ * for how much a print holds up the other clients.
+ */
+static void write_print(const char *dir, int clients, int ops) {
+    write_mixed(dir, clients, ops);
+
+    FILE *fp = open_file(dir, "setup.txt", "a");
+    fprintf(fp, "c /big d\n");
+    for (int a = 0; a < BIG_FANOUT; a++) {
+        fprintf(fp, "c /big/d%d d\n", a);
+        for (int b = 0; b < BIG_FANOUT; b++)
+            fprintf(fp, "c /big/d%d/f%d f\n", a, b);
+    }
+    fclose(fp);
+
+    fp = open_file(dir, "background.txt", "w");
+    for (int i = 0; i < BACKGROUND_PRINTS; i++)
+        fprintf(fp, "p /dev/null\n");
+    fclose(fp);
+}
+
+
+/*
+ * Rename workload: client 0 moves /a/f into /a/b and back, over and over,
+ * while the others create and delete files in /a/b. The move holds both
+ * parents, one the other's ancestor, and meets operations that hold the
+ * ancestor on their way down to the other.
+ */
+static void write_rename(const char *dir, int clients, int ops) {
+    char name[NAME_SIZE];
+    FILE *fp = open_file(dir, "setup.txt", "w");
+
+    fprintf(fp, "c /a d\nc /a/b d\nc /a/f f\n");
+    fclose(fp);
+
+    for (int i = 0; i < clients; i++) {
+        snprintf(name, sizeof(name), "client%d.txt", i);
+        fp = open_file(dir, name, "w");
+        for (int n = 0; n < ops; n += 2) {
+            if (i == 0)
+                fprintf(fp, "m /a/f /a/b/f\nm /a/b/f /a/f\n");
+            else
+                fprintf(fp, "c /a/b/z%d f\nd /a/b/z%d\n", i, i);
+        }
+        fclose(fp);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc != 5 || atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0) {
+        fprintf(stderr, "Usage: %s mixed|print|rename clients ops outdir\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *scenario = argv[1], *dir = argv[4];
+    int clients = atoi(argv[2]), ops = atoi(argv[3]);
+
+    if (strcmp(scenario, "mixed") == 0)
+        write_mixed(dir, clients, ops);
+    else if (strcmp(scenario, "print") == 0)
+        write_print(dir, clients, ops);
+    else if (strcmp(scenario, "rename") == 0)
+        write_rename(dir, clients, ops);
+    else {
+        fprintf(stderr, "Error: unknown scenario %s\n", scenario);
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,330 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "btree.h"
+#include "slab.h"
+#include "epoch.h"
+#include "state.h"
+
+
+static BtNode *node_new(int leaf) {
+    BtNode *node = slab_alloc(sizeof(BtNode));
+    node->leaf = leaf;
+    node->n = 0;
+    if (leaf) {
+        node->u.l.prev = NULL;
+        node->u.l.next = NULL;
+    }
+    return node;
+}
+
+
+static void node_free(BtNode *node) {
+    if (!node->leaf) {
+        for (int i = 0; i <= node->n; i++)
+            node_free(node->u.i.children[i]);
+    }
+    epoch_retire(node, sizeof(BtNode));
+}
+
+
+/* Orders the name of an entry against name, of len characters, the way strcmp does */
+static int entry_cmp(NameArena *arena, DirEntry *entry, const char *name, int len) {
+    int c = memcmp(DIR_ENTRY_NAME(arena, entry), name, entry->len < len ? entry->len : len);
+    return c != 0 ? c : entry->len - len;
+}
+
+
+/* Position of the first leaf entry whose name is not smaller than name */
+static int leaf_lower_bound(BtNode *leaf, NameArena *arena, const char *name, int len) {
+    int lo = 0, hi = leaf->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (entry_cmp(arena, &leaf->u.l.entries[mid], name, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+/* Index of the child of an inner node whose range holds name */
+static int inner_child(BtNode *node, NameArena *arena, const char *name, int len) {
+    int lo = 0, hi = node->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (entry_cmp(arena, &node->u.i.keys[mid], name, len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+static BtNode *find_leaf(Btree *tree, NameArena *arena, const char *name, int len) {
+    BtNode *node = tree->root;
+    while (node != NULL && !node->leaf)
+        node = node->u.i.children[inner_child(node, arena, name, len)];
+    return node;
+}
+
+
+/*
+ * Inserts into a leaf, splitting it when full.
+ * Returns: the new right sibling if the leaf split (its first entry is
+ * copied to sep), NULL otherwise. *status is FAIL if the name already exists.
+ */
+static BtNode *leaf_insert(BtNode *leaf, NameArena *arena, DirEntry *entry, DirEntry *sep, int *status) {
+    const char *name = DIR_ENTRY_NAME(arena, entry);
+    int pos = leaf_lower_bound(leaf, arena, name, entry->len);
+
+    if (pos < leaf->n && entry_cmp(arena, &leaf->u.l.entries[pos], name, entry->len) == 0) {
+        *status = FAIL;
+        return NULL;
+    }
+
+    if (leaf->n < BT_LEAF_MAX) {
+        memmove(&leaf->u.l.entries[pos + 1], &leaf->u.l.entries[pos], sizeof(DirEntry) * (leaf->n - pos));
+        memmove(&leaf->u.l.tags[pos + 1], &leaf->u.l.tags[pos], sizeof(unsigned short) * (leaf->n - pos));
+        leaf->u.l.entries[pos] = *entry;
+        leaf->u.l.tags[pos] = NAME_TAG(entry->hash, entry->len);
+        leaf->n++;
+        return NULL;
+    }
+
+    BtNode *right = node_new(1);
+    /* appending to the last leaf starts a new one, so names created in order fill leaves */
+    int half = (pos == BT_LEAF_MAX && leaf->u.l.next == NULL) ? BT_LEAF_MAX : BT_LEAF_MAX / 2;
+    memcpy(right->u.l.entries, &leaf->u.l.entries[half], sizeof(DirEntry) * (BT_LEAF_MAX - half));
+    memcpy(right->u.l.tags, &leaf->u.l.tags[half], sizeof(unsigned short) * (BT_LEAF_MAX - half));
+    right->n = BT_LEAF_MAX - half;
+    leaf->n = half;
+
+    right->u.l.next = leaf->u.l.next;
+    right->u.l.prev = leaf;
+    if (leaf->u.l.next != NULL)
+        leaf->u.l.next->u.l.prev = right;
+    leaf->u.l.next = right;
+
+    leaf_insert((pos <= half && leaf->n < BT_LEAF_MAX) ? leaf : right, arena, entry, sep, status);
+    *sep = right->u.l.entries[0];
+    return right;
+}
+
+
+/*
+ * Inserts below an inner node, splitting it when a child split overflows it.
+ * Returns: as leaf_insert, with sep set to the key pushed up.
+ */
+static BtNode *node_insert(BtNode *node, NameArena *arena, DirEntry *entry, DirEntry *sep, int *status) {
+    if (node->leaf)
+        return leaf_insert(node, arena, entry, sep, status);
+
+    DirEntry childSep;
+    int idx = inner_child(node, arena, DIR_ENTRY_NAME(arena, entry), entry->len);
+    BtNode *child = node_insert(node->u.i.children[idx], arena, entry, &childSep, status);
+    if (child == NULL)
+        return NULL;
+
+    if (node->n < BT_INNER_MAX) {
+        memmove(&node->u.i.keys[idx + 1], &node->u.i.keys[idx], sizeof(DirEntry) * (node->n - idx));
+        memmove(&node->u.i.children[idx + 2], &node->u.i.children[idx + 1], sizeof(BtNode *) * (node->n - idx));
+        node->u.i.keys[idx] = childSep;
+        node->u.i.children[idx + 1] = child;
+        node->n++;
+        return NULL;
+    }
+
+    /* gather the overflowing node, then keep the lower half and push the middle key up */
+    DirEntry keys[BT_INNER_MAX + 1];
+    BtNode *children[BT_INNER_MAX + 2];
+    memcpy(keys, node->u.i.keys, sizeof(DirEntry) * idx);
+    keys[idx] = childSep;
+    memcpy(&keys[idx + 1], &node->u.i.keys[idx], sizeof(DirEntry) * (BT_INNER_MAX - idx));
+    memcpy(children, node->u.i.children, sizeof(BtNode *) * (idx + 1));
+    children[idx + 1] = child;
+    memcpy(&children[idx + 2], &node->u.i.children[idx + 1], sizeof(BtNode *) * (BT_INNER_MAX - idx));
+
+    int mid = (BT_INNER_MAX + 1) / 2;
+    BtNode *right = node_new(0);
+    node->n = mid;
+    memcpy(node->u.i.keys, keys, sizeof(DirEntry) * mid);
+    memcpy(node->u.i.children, children, sizeof(BtNode *) * (mid + 1));
+    right->n = BT_INNER_MAX - mid;
+    memcpy(right->u.i.keys, &keys[mid + 1], sizeof(DirEntry) * right->n);
+    memcpy(right->u.i.children, &children[mid + 1], sizeof(BtNode *) * (right->n + 1));
+    *sep = keys[mid];
+    return right;
+}
+
+
+/*
+ * Removes below a node. Nodes left without entries are freed and unlinked
+ * instead of being merged with their siblings.
+ * Returns: 1 if the node became empty and was freed, 0 otherwise
+ */
+static int node_remove(BtNode *node, NameArena *arena, const char *name, int len, int inumber, int *status) {
+    if (node->leaf) {
+        int pos = leaf_lower_bound(node, arena, name, len);
+        if (pos == node->n || entry_cmp(arena, &node->u.l.entries[pos], name, len) != 0
+                || node->u.l.entries[pos].inumber != inumber) {
+            *status = FAIL;
+            return 0;
+        }
+        node->n--;
+        memmove(&node->u.l.entries[pos], &node->u.l.entries[pos + 1], sizeof(DirEntry) * (node->n - pos));
+        memmove(&node->u.l.tags[pos], &node->u.l.tags[pos + 1], sizeof(unsigned short) * (node->n - pos));
+        if (node->n > 0)
+            return 0;
+
+        if (node->u.l.prev != NULL)
+            node->u.l.prev->u.l.next = node->u.l.next;
+        if (node->u.l.next != NULL)
+            node->u.l.next->u.l.prev = node->u.l.prev;
+        epoch_retire(node, sizeof(BtNode));
+        return 1;
+    }
+
+    int idx = inner_child(node, arena, name, len);
+    if (!node_remove(node->u.i.children[idx], arena, name, len, inumber, status))
+        return 0;
+
+    if (node->n == 0) {
+        epoch_retire(node, sizeof(BtNode));
+        return 1;
+    }
+    /* drop the child and the key that separates it from its neighbour */
+    int key = idx == 0 ? 0 : idx - 1;
+    memmove(&node->u.i.keys[key], &node->u.i.keys[key + 1], sizeof(DirEntry) * (node->n - key - 1));
+    memmove(&node->u.i.children[idx], &node->u.i.children[idx + 1], sizeof(BtNode *) * (node->n - idx));
+    node->n--;
+    return 0;
+}
+
+
+void btree_init(Btree *tree) {
+    tree->root = NULL;
+}
+
+
+void btree_destroy(Btree *tree) {
+    if (tree->root != NULL)
+        node_free(tree->root);
+    tree->root = NULL;
+}
+
+
+/*
+ * Returns: the entry with the given name, of len characters and the given
+ * name_hash, or NULL
+ */
+DirEntry *btree_lookup(Btree *tree, NameArena *arena, const char *name, int len, unsigned int hash) {
+    BtNode *leaf = find_leaf(tree, arena, name, len);
+    if (leaf == NULL)
+        return NULL;
+
+    /* the leaf is only searched by tag, its order is not needed to find a name */
+    unsigned short tag = NAME_TAG(hash, len);
+    for (int group = 0; group < leaf->n; group += TAG_GROUP) {
+        unsigned int free, match = tags_match(&leaf->u.l.tags[group], tag, &free);
+        if (leaf->n - group < TAG_GROUP)
+            match &= (1u << (leaf->n - group)) - 1;
+        for (; match != 0; match &= match - 1) {
+            DirEntry *entry = &leaf->u.l.entries[group + __builtin_ctz(match)];
+            if (entry->hash == hash && entry_cmp(arena, entry, name, len) == 0)
+                return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Inserts a copy of the entry.
+ * Returns: SUCCESS or FAIL (name already exists)
+ */
+int btree_insert(Btree *tree, NameArena *arena, DirEntry *entry) {
+    DirEntry sep;
+    int status = SUCCESS;
+
+    if (tree->root == NULL)
+        tree->root = node_new(1);
+
+    BtNode *right = node_insert(tree->root, arena, entry, &sep, &status);
+    if (right != NULL) {
+        BtNode *root = node_new(0);
+        root->n = 1;
+        root->u.i.keys[0] = sep;
+        root->u.i.children[0] = tree->root;
+        root->u.i.children[1] = right;
+        tree->root = root;
+    }
+    return status;
+}
+
+
+/*
+ * Removes the entry with the given name, if it refers to the given inumber.
+ * Returns: SUCCESS or FAIL
+ */
+int btree_remove(Btree *tree, NameArena *arena, const char *name, int len, int inumber) {
+    int status = SUCCESS;
+
+    if (tree->root == NULL)
+        return FAIL;
+    if (node_remove(tree->root, arena, name, len, inumber, &status))
+        tree->root = NULL;
+
+    /* collapse roots left with a single child */
+    while (tree->root != NULL && !tree->root->leaf && tree->root->n == 0) {
+        BtNode *root = tree->root;
+        tree->root = root->u.i.children[0];
+        epoch_retire(root, sizeof(BtNode));
+    }
+    return status;
+}
+
+
+/*
+ * Finds the first entry whose name is not smaller than from.
+ * Returns: the leaf holding it, with its position in *pos, or NULL if there
+ * is none. Following leaves are reached through u.l.next.
+ */
+BtNode *btree_seek(Btree *tree, NameArena *arena, const char *from, int *pos) {
+    int len = strlen(from);
+    BtNode *leaf = find_leaf(tree, arena, from, len);
+    if (leaf == NULL)
+        return NULL;
+
+    *pos = leaf_lower_bound(leaf, arena, from, len);
+    if (*pos == leaf->n) {
+        *pos = 0;
+        leaf = leaf->u.l.next;
+    }
+    return leaf;
+}
+
+
+static void node_foreach(BtNode *node, void (*fn)(DirEntry *entry, void *arg), void *arg) {
+    if (node->leaf) {
+        for (int i = 0; i < node->n; i++)
+            fn(&node->u.l.entries[i], arg);
+        return;
+    }
+    for (int i = 0; i < node->n; i++)
+        fn(&node->u.i.keys[i], arg);
+    for (int i = 0; i <= node->n; i++)
+        node_foreach(node->u.i.children[i], fn, arg);
+}
+
+
+/*
+ * Calls fn on every entry of the tree, inner node keys included, so their
+ * names can be moved when the name arena is compacted.
+ */
+void btree_foreach(Btree *tree, void (*fn)(DirEntry *entry, void *arg), void *arg) {
+    if (tree->root != NULL)
+        node_foreach(tree->root, fn, arg);
+}
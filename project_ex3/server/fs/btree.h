@@ -0,0 +1,42 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include "dir.h"
+#include "tags.h"
+
+/* Entries per leaf and keys per inner node, sized so nodes fit a 3 KB slab */
+#define BT_LEAF_MAX 112
+#define BT_INNER_MAX 94
+
+/*
+ * B+tree node. Leaves hold the entries sorted by name and are linked in
+ * name order, with the tag of every entry packed apart so a lookup matches
+ * a name against the whole leaf without searching it; inner nodes hold a
+ * copy of the first entry of every child but the first. Long names of both
+ * are in the directory's name arena.
+ */
+typedef struct btNode {
+	int leaf;
+	int n; /* entries in a leaf, keys in an inner node */
+	union {
+		struct {
+			struct btNode *prev, *next;
+			DirEntry entries[BT_LEAF_MAX];
+			unsigned short tags[TAG_GROUPS(BT_LEAF_MAX)]; /* of entries[0, n) */
+		} l;
+		struct {
+			struct btNode *children[BT_INNER_MAX + 1];
+			DirEntry keys[BT_INNER_MAX];
+		} i;
+	} u;
+} BtNode;
+
+void btree_init(Btree *tree);
+void btree_destroy(Btree *tree);
+DirEntry *btree_lookup(Btree *tree, NameArena *arena, const char *name, int len, unsigned int hash);
+int btree_insert(Btree *tree, NameArena *arena, DirEntry *entry);
+int btree_remove(Btree *tree, NameArena *arena, const char *name, int len, int inumber);
+BtNode *btree_seek(Btree *tree, NameArena *arena, const char *from, int *pos);
+void btree_foreach(Btree *tree, void (*fn)(DirEntry *entry, void *arg), void *arg);
+
+#endif /* BTREE_H */
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dcache.h"
+#include "dir.h"
+#include "state.h"
+
+/*
+ * Dentry cache: full paths mapped to the i-nodes they lead through, so a
+ * lookup of a path resolved before goes straight to its last node instead
+ * of searching every directory on the way. Entries are never updated when
+ * the tree changes. Removing an entry from a directory, which every move
+ * and delete does, changes the path sequence number of the i-node it led
+ * to, so every cached path through that i-node, the whole subtree under it
+ * included, stops matching the numbers it was cached with.
+ *
+ * A smaller table keeps paths found not to exist, with the i-nodes down to
+ * the directory a name was missing from. They hold while those i-nodes
+ * stay where they were and no entry is added to that directory.
+ *
+ * Slots are read without locks, as seqlocks: a writer makes the slot's
+ * number odd while it fills it, and readers that see it change start
+ * over. A writer that finds the slot taken just leaves it, the cache is
+ * only a hint.
+ */
+
+typedef struct dentry {
+    unsigned int seq; /* odd while the slot is written */
+    unsigned int hash;
+    int len;          /* 0 for an empty slot */
+    char key[MAX_FILE_NAME];
+    unsigned long entrySeq; /* of the directory a name was missing from, for a path that does not exist */
+    dentryPath path;
+} __attribute__((aligned(CACHE_LINE_SIZE))) dentry;
+
+/* Lookups counted by each worker, so the counters are never shared */
+typedef struct dcacheStats {
+    long hits, absent, misses, stale, inserts;
+    struct dcacheStats *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) dcacheStats;
+
+static dentry dcache[DCACHE_SIZE];
+static dentry dcache_negative[DCACHE_NEGATIVE_SIZE];
+
+dcacheStats *dcache_stats_list = NULL; /* pushed under stats_mutex */
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread dcacheStats *thread_stats = NULL;
+
+
+/* Returns the calling worker's counters, registering them on first use */
+static dcacheStats *dcache_stats() {
+    if (thread_stats != NULL)
+        return thread_stats;
+
+    dcacheStats *stats;
+    if (posix_memalign((void **) &stats, CACHE_LINE_SIZE, sizeof(dcacheStats)) != 0) {
+        fprintf(stderr, "Error: failed to allocate dentry cache counters.\n");
+        exit(EXIT_FAILURE);
+    }
+    stats->hits = stats->absent = stats->misses = stats->stale = stats->inserts = 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    stats->next = dcache_stats_list;
+    dcache_stats_list = stats;
+    pthread_mutex_unlock(&stats_mutex);
+
+    thread_stats = stats;
+    return stats;
+}
+
+
+/*
+ * The key the first depth components of a path are cached under is those
+ * components joined by single slashes, so "/a//b/" and "a/b" share an
+ * entry. Its hash is the prefix hash of the last component.
+ * Returns: length of the key, or FAIL for the root or a key that does not fit
+ */
+static int dcache_key_len(const Path *path, int depth) {
+    int len;
+
+    if (depth <= 0 || depth > path->depth)
+        return FAIL;
+    len = path_key_len(path, depth);
+    return len < MAX_FILE_NAME ? len : FAIL;
+}
+
+
+/* Tells whether a key of the right length holds the first depth components of a path */
+static int dcache_key_equal(const char *key, const Path *path, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (i > 0 && *key++ != '/')
+            return 0;
+        if (memcmp(key, PATH_NAME(path, i), PATH_LEN(path, i)) != 0)
+            return 0;
+        key += PATH_LEN(path, i);
+    }
+    return 1;
+}
+
+
+/* Writes the key of the first depth components of a path */
+static void dcache_key_copy(char *key, const Path *path, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (i > 0)
+            *key++ = '/';
+        memcpy(key, PATH_NAME(path, i), PATH_LEN(path, i));
+        key += PATH_LEN(path, i);
+    }
+}
+
+
+/*
+ * Claims a slot for writing.
+ * Returns: the slot's number before it was claimed, or FAIL if another
+ *  worker is writing it
+ */
+static long dcache_claim(dentry *slot) {
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return FAIL;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return seq;
+}
+
+
+/*
+ * Copies what a slot holds for the key of the first depth components of a
+ * path, without locks.
+ * Returns: the slot's number, or FAIL if it does not hold the key
+ */
+static long dcache_read(dentry *slot, const Path *key, int depth, int len, unsigned int hash,
+                        dentryPath *path, unsigned long *entrySeq) {
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    int match = !(seq & 1) && slot->hash == hash && slot->len == len && dcache_key_equal(slot->key, key, depth);
+
+    if (match) {
+        *path = slot->path;
+        *entrySeq = slot->entrySeq;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return match && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq ? (long) seq : FAIL;
+}
+
+
+/* Empties a slot found stale, so later lookups do not check it again, unless it was refilled since */
+static void dcache_drop(dentry *slot, unsigned int seq) {
+    long old = dcache_claim(slot);
+
+    if (old == FAIL)
+        return;
+    if (old == seq)
+        slot->len = 0;
+    __atomic_store_n(&slot->seq, old + 2, __ATOMIC_RELEASE);
+}
+
+
+/* Fills a slot, unless another worker is writing it */
+static void dcache_write(dentry *slot, const Path *key, int depth, int len, unsigned int hash,
+                         const dentryPath *resolved, unsigned long entrySeq) {
+    long old = dcache_claim(slot);
+
+    if (old == FAIL)
+        return;
+    slot->hash = hash;
+    slot->len = len;
+    dcache_key_copy(slot->key, key, depth);
+    slot->entrySeq = entrySeq;
+    slot->path = *resolved;
+    __atomic_store_n(&slot->seq, old + 2, __ATOMIC_RELEASE);
+    dcache_stats()->inserts++;
+}
+
+
+/* Tells whether none of the i-nodes of a path was being removed from a directory when it was resolved */
+static int dcache_settled(const dentryPath *resolved) {
+    if (resolved->depth < 0 || resolved->depth > DCACHE_MAX_DEPTH)
+        return 0;
+    for (int i = 0; i < resolved->depth; i++) {
+        if (resolved->seqs[i] & 1)
+            return 0;
+    }
+    return 1;
+}
+
+
+void dcache_init() {
+    memset(dcache, 0, sizeof(dcache));
+    memset(dcache_negative, 0, sizeof(dcache_negative));
+}
+
+
+/*
+ * Looks a path up in the cache, without locks.
+ * Input:
+ *  - path, depth: the node is at the first depth components of path
+ *  - found: filled with the i-nodes of the path on SUCCESS
+ * Returns: SUCCESS, if every i-node of the path is still where it was when
+ *  the path was cached, DCACHE_ABSENT if the path is known not to exist,
+ *  or FAIL
+ */
+int dcache_lookup(const Path *path, int depth, dentryPath *found) {
+    int len = dcache_key_len(path, depth);
+    unsigned long entrySeq;
+    long seq;
+
+    if (len == FAIL)
+        return FAIL;
+
+    unsigned int hash = path->components[depth - 1].prefixHash;
+    dentry *slot = &dcache[hash & (DCACHE_SIZE - 1)];
+    if ((seq = dcache_read(slot, path, depth, len, hash, found, &entrySeq)) != FAIL) {
+        if (dcache_valid(found)) {
+            dcache_stats()->hits++;
+            return SUCCESS;
+        }
+        dcache_stats()->stale++;
+        dcache_drop(slot, seq);
+    }
+
+    slot = &dcache_negative[hash & (DCACHE_NEGATIVE_SIZE - 1)];
+    if ((seq = dcache_read(slot, path, depth, len, hash, found, &entrySeq)) != FAIL) {
+        int dir = found->depth > 0 ? found->inumbers[found->depth - 1] : FS_ROOT;
+        if (dcache_valid(found) && inode_entry_seq(dir) == entrySeq) {
+            dcache_stats()->absent++;
+            return DCACHE_ABSENT;
+        }
+        dcache_stats()->stale++;
+        dcache_drop(slot, seq);
+        return FAIL;
+    }
+    dcache_stats()->misses++;
+    return FAIL;
+}
+
+
+/*
+ * Caches the i-nodes a path was resolved to. Paths too deep, or with an
+ * i-node that was being removed from a directory while it was resolved,
+ * are left out.
+ * Input:
+ *  - path, depth: the node is at the first depth components of path
+ *  - resolved: the i-nodes of the path, with the path sequence number each
+ *    one had while its entry was seen in its parent
+ */
+void dcache_insert(const Path *path, int depth, const dentryPath *resolved) {
+    int len = dcache_key_len(path, depth);
+
+    if (len == FAIL || resolved->depth <= 0 || !dcache_settled(resolved))
+        return;
+    unsigned int hash = path->components[depth - 1].prefixHash;
+    dcache_write(&dcache[hash & (DCACHE_SIZE - 1)], path, depth, len, hash, resolved, 0);
+}
+
+
+/*
+ * Caches a path that does not exist.
+ * Input:
+ *  - path, depth: the node is at the first depth components of path
+ *  - resolved: the i-nodes of the path down to the directory the next name
+ *    was missing from, as for dcache_insert
+ *  - entrySeq: entry sequence number of that directory, read before the
+ *    name was looked for
+ */
+void dcache_insert_absent(const Path *path, int depth, const dentryPath *resolved, unsigned long entrySeq) {
+    int len = dcache_key_len(path, depth);
+
+    if (len == FAIL || !ENTRY_SEQ_SETTLED(entrySeq) || !dcache_settled(resolved))
+        return;
+    unsigned int hash = path->components[depth - 1].prefixHash;
+    dcache_write(&dcache_negative[hash & (DCACHE_NEGATIVE_SIZE - 1)], path, depth, len, hash, resolved, entrySeq);
+}
+
+
+/*
+ * Tells whether every i-node of a resolved path is still where it was.
+ */
+int dcache_valid(const dentryPath *resolved) {
+    for (int i = 0; i < resolved->depth; i++) {
+        if (inode_path_seq(resolved->inumbers[i]) != resolved->seqs[i])
+            return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Prints how many lookups the cache answered, missed, or found stale.
+ */
+void dcache_print_stats(FILE *fp) {
+    long hits = 0, absent = 0, misses = 0, stale = 0, inserts = 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    for (dcacheStats *stats = dcache_stats_list; stats != NULL; stats = stats->next) {
+        hits += __atomic_load_n(&stats->hits, __ATOMIC_RELAXED);
+        absent += __atomic_load_n(&stats->absent, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&stats->misses, __ATOMIC_RELAXED);
+        stale += __atomic_load_n(&stats->stale, __ATOMIC_RELAXED);
+        inserts += __atomic_load_n(&stats->inserts, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    fprintf(fp, "dentry cache: %ld hits, %ld known missing, %ld misses, %ld stale, %ld paths cached\n",
+            hits, absent, misses, stale, inserts);
+}
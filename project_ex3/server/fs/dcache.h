@@ -0,0 +1,35 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdio.h>
+#include "../../tecnicofs-api-constants.h"
+#include "path.h"
+
+/* Cached paths, a power of two */
+#define DCACHE_SIZE 4096
+/* Paths known not to exist, a power of two */
+#define DCACHE_NEGATIVE_SIZE 1024
+/* Paths with more components are not cached */
+#define DCACHE_MAX_DEPTH 16
+
+/* dcache_lookup found the path is known not to exist */
+#define DCACHE_ABSENT -4
+
+/*
+ * I-nodes a path leads through, the root left out, with the path sequence
+ * number each one had when the path was resolved.
+ */
+typedef struct dentryPath {
+    int depth;
+    int inumbers[DCACHE_MAX_DEPTH];
+    unsigned int seqs[DCACHE_MAX_DEPTH];
+} dentryPath;
+
+void dcache_init();
+int dcache_lookup(const Path *path, int depth, dentryPath *found);
+void dcache_insert(const Path *path, int depth, const dentryPath *resolved);
+void dcache_insert_absent(const Path *path, int depth, const dentryPath *resolved, unsigned long entrySeq);
+int dcache_valid(const dentryPath *resolved);
+void dcache_print_stats(FILE *fp);
+
+#endif /* DCACHE_H */
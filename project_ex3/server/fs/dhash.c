@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dhash.h"
+#include "slab.h"
+#include "epoch.h"
+#include "state.h"
+
+/*
+ * Global dentry table: the entries of every directory in one hash table
+ * keyed by (parent inumber, name hash), used instead of a table per
+ * directory when built with -DDIR_GLOBAL_TABLE. A lookup is one probe
+ * however large the directory, and the table grows a bucket at a time as
+ * entries are added instead of being rehashed at once.
+ *
+ * Lookups take no lock: they walk the list from their bucket's head inside
+ * an epoch, and removed entries are retired through epochs. Writers take the
+ * lock of their key, which covers every node they may change: the nodes
+ * between a bucket head and the next are all of keys equal modulo
+ * DHASH_LOCKS. Writers of one directory are also serialized by its i-node
+ * lock, which is what keeps the chain of its entries consistent.
+ */
+
+#define DHASH_ENTRY_SIZE(len) (sizeof(DhashEntry) + (len) + 1)
+
+typedef struct dhashLock {
+    pthread_mutex_t mutex;
+    long entries; /* of keys under the lock */
+} __attribute__((aligned(CACHE_LINE_SIZE))) dhashLock;
+
+static DhashNode *dhash_segments[DHASH_MAX_SEGMENTS]; /* bucket heads, allocated on first use */
+static dhashLock dhash_locks[DHASH_LOCKS];
+static unsigned int dhash_size; /* buckets in use, a power of two */
+static long dhash_heads;        /* bucket heads in the list */
+
+
+/* Mixes the inumber of the directory into the hash of a name */
+static unsigned int dhash_key(int parent, unsigned int hash) {
+    unsigned int key = hash ^ ((unsigned int) parent * 0x9E3779B1u);
+    key ^= key >> 16;
+    key *= 0x85EBCA6Bu;
+    key ^= key >> 13;
+    return key;
+}
+
+
+static unsigned int reverse_bits(unsigned int x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+
+/* Position of an entry in the list. Keys equal but for the top bit share it. */
+static unsigned int entry_order(unsigned int key) {
+    return reverse_bits(key) | 1;
+}
+
+
+/* The bucket a bucket was split from: itself without its highest bit */
+static unsigned int bucket_parent(unsigned int bucket) {
+    return bucket & ~(1u << (31 - __builtin_clz(bucket)));
+}
+
+
+/* Returns the head of a bucket, allocating its segment if no one did */
+static DhashNode *bucket_slot(unsigned int bucket) {
+    DhashNode **segment = &dhash_segments[bucket / DHASH_SEGMENT_SIZE];
+    DhashNode *heads = __atomic_load_n(segment, __ATOMIC_ACQUIRE);
+
+    if (heads == NULL) {
+        DhashNode *fresh = calloc(DHASH_SEGMENT_SIZE, sizeof(DhashNode));
+        if (fresh == NULL) {
+            fprintf(stderr, "Error: failed to allocate dentry table buckets.\n");
+            exit(EXIT_FAILURE);
+        }
+        /* writers of other keys may be allocating the same segment */
+        if (__atomic_compare_exchange_n(segment, &heads, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            heads = fresh;
+        else
+            free(fresh);
+    }
+    return &heads[bucket % DHASH_SEGMENT_SIZE];
+}
+
+
+/*
+ * Returns the head of a bucket, or of the bucket it was split from if it is
+ * not in the list yet, which comes before it in the list. Takes no lock.
+ */
+static DhashNode *bucket_find(unsigned int bucket) {
+    for (;;) {
+        DhashNode *heads = __atomic_load_n(&dhash_segments[bucket / DHASH_SEGMENT_SIZE], __ATOMIC_ACQUIRE);
+        if (heads != NULL && __atomic_load_n(&heads[bucket % DHASH_SEGMENT_SIZE].ready, __ATOMIC_ACQUIRE))
+            return &heads[bucket % DHASH_SEGMENT_SIZE];
+        /* the first DHASH_LOCKS buckets are always ready */
+        bucket = bucket_parent(bucket);
+    }
+}
+
+
+/*
+ * Returns the head of a bucket, adding it to the list after the head of
+ * the bucket it was split from if it is not there yet. The caller holds the
+ * lock of the bucket's keys.
+ */
+static DhashNode *bucket_ready(unsigned int bucket) {
+    DhashNode *head = bucket_slot(bucket);
+
+    if (__atomic_load_n(&head->ready, __ATOMIC_ACQUIRE))
+        return head;
+
+    DhashNode *prev = bucket_ready(bucket_parent(bucket)), *next;
+    head->order = reverse_bits(bucket);
+    while ((next = prev->next) != NULL && next->order < head->order)
+        prev = next;
+    head->next = next;
+    __atomic_store_n(&prev->next, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&head->ready, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&dhash_heads, 1, __ATOMIC_RELAXED);
+    return head;
+}
+
+
+/*
+ * Walks the list from a bucket head to where a key goes.
+ * Input:
+ *  - head: head of the key's bucket, or of one it was split from
+ *  - prev: set to the node after which the entry is, or would be inserted
+ * Returns: the entry with the name in the directory, or NULL
+ */
+static DhashEntry *list_find(DhashNode *head, unsigned int order, int parent, const char *name, int len,
+                             unsigned int hash, DhashNode **prev) {
+    DhashNode *node;
+
+    for (*prev = head; (node = __atomic_load_n(&(*prev)->next, __ATOMIC_ACQUIRE)) != NULL; *prev = node) {
+        if (node->order > order)
+            break;
+        DhashEntry *entry = (DhashEntry *) node;
+        if (node->order == order && entry->parent == parent && entry->hash == hash
+                && entry->len == len && memcmp(entry->name, name, len) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+
+void dhash_init() {
+    for (int i = 0; i < DHASH_LOCKS; i++) {
+        pthread_mutex_init(&dhash_locks[i].mutex, NULL);
+        dhash_locks[i].entries = 0;
+    }
+    memset(dhash_segments, 0, sizeof(dhash_segments));
+    dhash_size = DHASH_LOCKS;
+    dhash_heads = 0;
+
+    /* the first buckets are added in order, each after the one before in split order */
+    DhashNode *root = bucket_slot(0);
+    root->order = 0;
+    root->next = NULL;
+    root->ready = 1;
+    dhash_heads = 1;
+    for (unsigned int bucket = 1; bucket < DHASH_LOCKS; bucket++)
+        bucket_ready(bucket);
+}
+
+
+/*
+ * Frees the bucket heads. Every entry must have been removed.
+ */
+void dhash_destroy() {
+    for (int i = 0; i < DHASH_MAX_SEGMENTS; i++) {
+        free(dhash_segments[i]);
+        dhash_segments[i] = NULL;
+    }
+    for (int i = 0; i < DHASH_LOCKS; i++)
+        pthread_mutex_destroy(&dhash_locks[i].mutex);
+}
+
+
+/*
+ * Looks for an entry by name, without locks.
+ * Input:
+ *  - parent: inumber of the directory
+ *  - name, len, hash: name of the entry, its length and name_hash
+ * Returns: inumber of the entry, or FAIL
+ */
+int dhash_lookup(int parent, const char *name, int len, unsigned int hash) {
+    unsigned int key = dhash_key(parent, hash);
+    DhashNode *prev;
+    int inumber = FAIL;
+
+    epoch_enter();
+    DhashNode *head = bucket_find(key & (__atomic_load_n(&dhash_size, __ATOMIC_ACQUIRE) - 1));
+    DhashEntry *entry = list_find(head, entry_order(key), parent, name, len, hash, &prev);
+    if (entry != NULL)
+        inumber = entry->inumber;
+    epoch_exit();
+    return inumber;
+}
+
+
+/*
+ * Adds an entry, at the front of the chain of its directory. The caller
+ * excludes other writers of the directory.
+ * Input:
+ *  - children: first entry of the directory
+ *  - parent: inumber of the directory
+ *  - name, len, hash: name of the entry, its length and name_hash
+ *  - inumber: what the entry refers to
+ * Returns: SUCCESS, or FAIL if the name exists
+ */
+int dhash_insert(DhashEntry **children, int parent, const char *name, int len, unsigned int hash, int inumber) {
+    unsigned int key = dhash_key(parent, hash);
+    dhashLock *lock = &dhash_locks[key & (DHASH_LOCKS - 1)];
+    DhashNode *prev;
+
+    pthread_mutex_lock(&lock->mutex);
+    unsigned int size = __atomic_load_n(&dhash_size, __ATOMIC_ACQUIRE);
+    DhashNode *head = bucket_ready(key & (size - 1));
+    if (list_find(head, entry_order(key), parent, name, len, hash, &prev) != NULL) {
+        pthread_mutex_unlock(&lock->mutex);
+        return FAIL;
+    }
+
+    DhashEntry *entry = slab_alloc(DHASH_ENTRY_SIZE(len));
+    entry->node.order = entry_order(key);
+    entry->node.ready = 0;
+    entry->parent = parent;
+    entry->inumber = inumber;
+    entry->hash = hash;
+    entry->len = len;
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->node.next = prev->next;
+    __atomic_store_n(&prev->next, &entry->node, __ATOMIC_RELEASE);
+
+    /* grow once this lock's share of the buckets is loaded past DHASH_LOAD */
+    if (++lock->entries * DHASH_LOCKS > (long) size * DHASH_LOAD
+            && size < (unsigned int) DHASH_SEGMENT_SIZE * DHASH_MAX_SEGMENTS)
+        __atomic_compare_exchange_n(&dhash_size, &size, size * 2, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock->mutex);
+
+    entry->sibling = *children;
+    entry->prevSibling = NULL;
+    if (*children != NULL)
+        (*children)->prevSibling = entry;
+    __atomic_store_n(children, entry, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+
+/*
+ * Takes an entry out of the list and of the chain of its directory, and
+ * retires it. The caller excludes other writers of the directory.
+ */
+static void entry_unlink(DhashEntry **children, DhashEntry *entry, DhashNode *prev) {
+    __atomic_store_n(&prev->next, entry->node.next, __ATOMIC_RELEASE);
+
+    if (entry->prevSibling != NULL)
+        __atomic_store_n(&entry->prevSibling->sibling, entry->sibling, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(children, entry->sibling, __ATOMIC_RELEASE);
+    if (entry->sibling != NULL)
+        entry->sibling->prevSibling = entry->prevSibling;
+    epoch_retire(entry, DHASH_ENTRY_SIZE(entry->len));
+}
+
+
+/*
+ * Removes the entry with the given name, if it refers to the given inumber.
+ * The caller excludes other writers of the directory.
+ * Returns: SUCCESS or FAIL
+ */
+int dhash_remove(DhashEntry **children, int parent, const char *name, int len, unsigned int hash, int inumber) {
+    unsigned int key = dhash_key(parent, hash);
+    dhashLock *lock = &dhash_locks[key & (DHASH_LOCKS - 1)];
+    DhashNode *prev;
+    int result = FAIL;
+
+    pthread_mutex_lock(&lock->mutex);
+    DhashNode *head = bucket_ready(key & (__atomic_load_n(&dhash_size, __ATOMIC_ACQUIRE) - 1));
+    DhashEntry *entry = list_find(head, entry_order(key), parent, name, len, hash, &prev);
+    if (entry != NULL && entry->inumber == inumber) {
+        lock->entries--;
+        entry_unlink(children, entry, prev);
+        result = SUCCESS;
+    }
+    pthread_mutex_unlock(&lock->mutex);
+    return result;
+}
+
+
+/*
+ * Removes every entry of a directory that no one else can reach anymore.
+ */
+void dhash_clear(DhashEntry **children) {
+    while (*children != NULL) {
+        DhashEntry *entry = *children;
+        dhash_remove(children, entry->parent, entry->name, entry->len, entry->hash, entry->inumber);
+    }
+}
+
+
+/*
+ * Prints the size of the table.
+ */
+void dhash_print_stats(FILE *fp) {
+    long entries = 0;
+
+    for (int i = 0; i < DHASH_LOCKS; i++) {
+        pthread_mutex_lock(&dhash_locks[i].mutex);
+        entries += dhash_locks[i].entries;
+        pthread_mutex_unlock(&dhash_locks[i].mutex);
+    }
+    fprintf(fp, "dentry table: %ld entries, %u buckets, %ld in use\n", entries,
+            __atomic_load_n(&dhash_size, __ATOMIC_RELAXED), __atomic_load_n(&dhash_heads, __ATOMIC_RELAXED));
+}
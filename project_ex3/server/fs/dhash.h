@@ -0,0 +1,56 @@
+#ifndef DHASH_H
+#define DHASH_H
+
+#include <stdio.h>
+#include "../../tecnicofs-api-constants.h"
+
+/* Bucket heads are allocated in segments of this many, up to DHASH_MAX_SEGMENTS */
+#define DHASH_SEGMENT_SIZE 1024
+#define DHASH_MAX_SEGMENTS 4096
+/*
+ * Locks writers take, chosen by key. The table starts with this many
+ * buckets, so every bucket a key hashes to as the table grows shares its
+ * lock. A power of two.
+ */
+#define DHASH_LOCKS 256
+/* Entries per bucket, on average, before the number of buckets doubles */
+#define DHASH_LOAD 2
+
+/*
+ * Node of the one list every entry of the table is in, sorted by the key
+ * with its bits reversed (split order). Each bucket points into the list at
+ * a head of its own, so doubling the number of buckets only means adding
+ * heads to the list, one by one as the new buckets are first written, and
+ * no entry ever moves.
+ */
+typedef struct dhashNode {
+    struct dhashNode *next;
+    unsigned int order; /* odd for entries, even for bucket heads */
+    int ready;          /* set once a bucket head is in the list */
+} DhashNode;
+
+/*
+ * Entry of a directory, keyed by the inumber of the directory and the hash
+ * of the name. Entries of a directory are also chained to each other, for
+ * listings. Nothing in an entry changes once it is in the table.
+ */
+typedef struct dhashEntry {
+    DhashNode node;
+    int parent;
+    int inumber;
+    unsigned int hash;
+    struct dhashEntry *sibling;     /* next entry of the directory, newest first */
+    struct dhashEntry *prevSibling; /* only followed by writers */
+    unsigned char len;
+    char name[];
+} DhashEntry;
+
+void dhash_init();
+void dhash_destroy();
+int dhash_lookup(int parent, const char *name, int len, unsigned int hash);
+int dhash_insert(DhashEntry **children, int parent, const char *name, int len, unsigned int hash, int inumber);
+int dhash_remove(DhashEntry **children, int parent, const char *name, int len, unsigned int hash, int inumber);
+void dhash_clear(DhashEntry **children);
+void dhash_print_stats(FILE *fp);
+
+#endif /* DHASH_H */
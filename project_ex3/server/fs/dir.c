@@ -0,0 +1,1190 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dir.h"
+#include "btree.h"
+#include "slab.h"
+#include "epoch.h"
+#include "dhash.h"
+#include "tags.h"
+#include "state.h"
+
+
+/*
+ * FNV-1a hash of an entry name.
+ */
+unsigned int name_hash(const char *name) {
+    unsigned int hash = NAME_HASH_INIT;
+    for (; *name != '\0'; name++)
+        hash = NAME_HASH_STEP(hash, *name);
+    return hash;
+}
+
+
+/*
+ * Appends a long name to the arena of the directory.
+ * Returns: offset of the name
+ */
+static unsigned int arena_add(NameArena *arena, const char *name, int len) {
+    if (arena->size + len + 1 > arena->capacity) {
+        int capacity = arena->capacity == 0 ? 256 : arena->capacity * 2;
+        while (capacity < arena->size + len + 1)
+            capacity *= 2;
+        /* the old buffer may still be read by optimistic lookups */
+        char *buf = slab_alloc(capacity);
+        memcpy(buf, arena->buf, arena->size);
+        epoch_retire(arena->buf, arena->capacity);
+        arena->buf = buf;
+        arena->capacity = capacity;
+    }
+    unsigned int offset = arena->size;
+    memcpy(arena->buf + offset, name, len);
+    arena->buf[offset + len] = '\0';
+    arena->size += len + 1;
+    return offset;
+}
+
+
+/* Copies a long name into the arena being compacted into */
+static void arena_move_name(DirEntry *entry, void *arg) {
+    NameArena *arenas = arg; /* old, new */
+    if (entry->len >= DIR_SHORT_NAME)
+        entry->name.offset = arena_add(&arenas[1], arenas[0].buf + entry->name.offset, entry->len);
+}
+
+
+/*
+ * Rebuilds the name arena without the names of removed entries.
+ */
+static void arena_compact(Directory *dir) {
+    NameArena arenas[2] = { dir->arena, { NULL, 0, 0, 0 } };
+
+    switch (dir->kind) {
+        case DIR_INLINE:
+            for (int i = 0; i < dir->count; i++)
+                arena_move_name(&dir->u.entries[i], arenas);
+            break;
+        case DIR_HASH:
+            for (int i = 0; i < dir->u.hash.capacity; i++) {
+                if (dir->u.hash.entries[i].inumber >= 0)
+                    arena_move_name(&dir->u.hash.entries[i], arenas);
+            }
+            break;
+        case DIR_BTREE:
+            btree_foreach(&dir->u.btree, arena_move_name, arenas);
+            break;
+        case DIR_CONCURRENT:
+        case DIR_GLOBAL:
+            /* names are kept with the slots or the entries, never in the arena */
+            break;
+    }
+    epoch_retire(arenas[0].buf, arenas[0].capacity);
+    dir->arena = arenas[1];
+}
+
+
+static void entry_set(Directory *dir, DirEntry *entry, const char *name, int len, unsigned int hash, int inumber) {
+    entry->hash = hash;
+    entry->inumber = inumber;
+    entry->len = len;
+    if (len < DIR_SHORT_NAME) {
+        memcpy(entry->name.inl, name, len);
+        entry->name.inl[len] = '\0';
+    }
+    else
+        entry->name.offset = arena_add(&dir->arena, name, len);
+}
+
+
+static int entry_matches(Directory *dir, DirEntry *entry, const char *name, int len, unsigned int hash) {
+    return entry->hash == hash && entry->len == len && memcmp(DIR_ENTRY_NAME(&dir->arena, entry), name, len) == 0;
+}
+
+
+/* Accounts for the name of a removed entry, compacting the arena if it is mostly garbage */
+static void entry_release(Directory *dir, int len) {
+    if (len < DIR_SHORT_NAME)
+        return;
+    dir->arena.garbage += len + 1;
+    if (dir->arena.garbage >= DIR_ARENA_MIN_GARBAGE && dir->arena.garbage * 2 > dir->arena.size)
+        arena_compact(dir);
+}
+
+
+/* Entries of a hash table, followed by their tags */
+#define HASH_TABLE_SIZE(capacity) (sizeof(DirEntry) * (capacity) + sizeof(unsigned short) * ((capacity) + TAG_GROUP))
+
+/* Gives a DIR_HASH directory an empty table */
+static void hash_alloc(Directory *dir, int capacity) {
+    DirEntry *entries = slab_alloc(HASH_TABLE_SIZE(capacity));
+    for (int i = 0; i < capacity; i++) {
+        entries[i].inumber = DIR_SLOT_FREE;
+    }
+    dir->u.hash.entries = entries;
+    dir->u.hash.tags = (unsigned short *) (entries + capacity);
+    memset(dir->u.hash.tags, 0, sizeof(unsigned short) * (capacity + TAG_GROUP));
+    dir->u.hash.capacity = capacity;
+    dir->u.hash.used = 0;
+}
+
+
+#define FILTER_BLOCK_WORDS (CACHE_LINE_SIZE / sizeof(unsigned long))
+#define FILTER_BLOCK_BITS (CACHE_LINE_SIZE * 8)
+#define FILTER_SIZE(blocks) (sizeof(DirFilter) + CACHE_LINE_SIZE * (blocks))
+
+/* Creates an empty filter for at least the given number of entries */
+static DirFilter *filter_alloc(int entries) {
+    int blocks = 1;
+
+    if (entries < DIR_FILTER_MIN_ENTRIES)
+        entries = DIR_FILTER_MIN_ENTRIES;
+    while (blocks * FILTER_BLOCK_BITS < entries * DIR_FILTER_BITS)
+        blocks *= 2;
+
+    DirFilter *filter = slab_alloc(FILTER_SIZE(blocks));
+    filter->blocks = blocks;
+    filter->entries = blocks * FILTER_BLOCK_BITS / DIR_FILTER_BITS;
+    filter->removed = 0;
+    memset(filter->words, 0, CACHE_LINE_SIZE * blocks);
+    return filter;
+}
+
+
+static void filter_free(DirFilter *filter) {
+    if (filter != NULL)
+        epoch_retire(filter, FILTER_SIZE(filter->blocks));
+}
+
+
+/*
+ * Word and bit of the probe-th bit of a name in its block. The block comes
+ * from the low bits of the hash, the bits in it from the high bits of a
+ * multiplicative mix of it.
+ */
+static unsigned long filter_bit(unsigned int hash, int probe, int *word) {
+    unsigned int bit = ((hash * 0x9E3779B1u) >> (32 - 9 * (probe + 1))) & (FILTER_BLOCK_BITS - 1);
+    *word = bit / 64;
+    return 1UL << (bit % 64);
+}
+
+
+/* Sets the bits of a name. Safe against concurrent adds and lookups. */
+static void filter_add(DirFilter *filter, unsigned int hash) {
+    unsigned long *block = &filter->words[(hash & (filter->blocks - 1)) * FILTER_BLOCK_WORDS];
+    int word;
+
+    for (int probe = 0; probe < DIR_FILTER_PROBES; probe++) {
+        unsigned long bit = filter_bit(hash, probe, &word);
+        __atomic_fetch_or(&block[word], bit, __ATOMIC_RELEASE);
+    }
+}
+
+
+/* Tells whether a name may be in the directory, 0 if it surely is not */
+static int filter_may_contain(const DirFilter *filter, unsigned int hash) {
+    const unsigned long *block = &filter->words[(hash & (filter->blocks - 1)) * FILTER_BLOCK_WORDS];
+    int word;
+
+    for (int probe = 0; probe < DIR_FILTER_PROBES; probe++) {
+        unsigned long bit = filter_bit(hash, probe, &word);
+        if (!(__atomic_load_n(&block[word], __ATOMIC_ACQUIRE) & bit))
+            return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Replaces the filter of a directory with one of the live entries, sized
+ * for the given number. No other insert or remove may run meanwhile.
+ */
+static void filter_rebuild(Directory *dir, int entries) {
+    DirFilter *filter = filter_alloc(entries);
+    DirIter it;
+    DirEntry *entry;
+
+    if (dir->kind == DIR_CONCURRENT) {
+        DirTable *table = dir->u.table;
+        for (int i = 0; i < table->capacity; i++) {
+            if (table->slots[i].name != NULL && table->slots[i].inumber >= 0)
+                filter_add(filter, table->slots[i].name->hash);
+        }
+    }
+    else {
+        directory_iter_init(&it, dir);
+        while ((entry = directory_iter_next(&it)) != NULL)
+            filter_add(filter, entry->hash);
+    }
+    filter_free(dir->filter);
+    __atomic_store_n(&dir->filter, filter, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Accounts for a name removed from a DIR_HASH or DIR_BTREE directory,
+ * rebuilding the filter once removed names outnumber the live ones.
+ */
+static void filter_removed(Directory *dir) {
+    if (dir->filter != NULL && ++dir->filter->removed > dir->count
+            && dir->filter->removed >= DIR_FILTER_MIN_ENTRIES)
+        filter_rebuild(dir, dir->count * 2);
+}
+
+
+/* Sets the tag of a slot, and its copy past the end for groups that wrap around */
+static void hash_set_tag(Directory *dir, int slot, unsigned short tag) {
+    dir->u.hash.tags[slot] = tag;
+    if (slot < TAG_GROUP)
+        dir->u.hash.tags[dir->u.hash.capacity + slot] = tag;
+}
+
+
+/* Puts an entry in the first free or deleted slot of its probe sequence */
+static void hash_place(Directory *dir, DirEntry *entry) {
+    int mask = dir->u.hash.capacity - 1;
+    int slot = entry->hash & mask;
+
+    while (dir->u.hash.entries[slot].inumber >= 0)
+        slot = (slot + 1) & mask;
+    if (dir->u.hash.entries[slot].inumber == DIR_SLOT_FREE)
+        dir->u.hash.used++;
+    dir->u.hash.entries[slot] = *entry;
+    hash_set_tag(dir, slot, NAME_TAG(entry->hash, entry->len));
+}
+
+
+/*
+ * Moves every live entry to a new table with the given capacity, dropping
+ * the tombstones.
+ */
+static void hash_rehash(Directory *dir, int capacity) {
+    DirEntry *old = dir->u.hash.entries;
+    int oldCapacity = dir->u.hash.capacity;
+
+    hash_alloc(dir, capacity);
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].inumber >= 0)
+            hash_place(dir, &old[i]);
+    }
+    epoch_retire(old, HASH_TABLE_SIZE(oldCapacity));
+}
+
+
+/*
+ * Finds the slot holding the given name, comparing the tags of TAG_GROUP
+ * slots of its probe sequence at once. Only entries whose tag matches are
+ * read, and the sequence ends at the first free slot.
+ * Returns: slot index or FAIL
+ */
+static int hash_find(Directory *dir, const char *name, int len, unsigned int hash) {
+    int mask = dir->u.hash.capacity - 1;
+    unsigned short tag = NAME_TAG(hash, len);
+
+    for (int group = hash & mask;; group = (group + TAG_GROUP) & mask) {
+        unsigned int free, match = tags_match(&dir->u.hash.tags[group], tag, &free);
+        if (free != 0)
+            match &= (free & -free) - 1;
+        for (; match != 0; match &= match - 1) {
+            int slot = (group + __builtin_ctz(match)) & mask;
+            if (entry_matches(dir, &dir->u.hash.entries[slot], name, len, hash))
+                return slot;
+        }
+        /* the load factor is kept under 3/4, so every sequence has a free slot */
+        if (free != 0)
+            return FAIL;
+    }
+}
+
+
+/* Smallest table that keeps count entries under half load */
+static int hash_capacity_for(int count) {
+    int capacity = DIR_INITIAL_CAPACITY;
+    while (capacity < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+
+static void inline_to_hash(Directory *dir) {
+    DirEntry entries[DIR_INLINE_MAX];
+    memcpy(entries, dir->u.entries, sizeof(DirEntry) * dir->count);
+
+    dir->kind = DIR_HASH;
+    hash_alloc(dir, hash_capacity_for(dir->count + 1));
+    for (int i = 0; i < dir->count; i++)
+        hash_place(dir, &entries[i]);
+}
+
+
+static void hash_to_inline(Directory *dir) {
+    DirEntry *table = dir->u.hash.entries;
+    int capacity = dir->u.hash.capacity;
+    int n = 0;
+
+    dir->kind = DIR_INLINE;
+    for (int i = 0; i < capacity; i++) {
+        if (table[i].inumber >= 0)
+            dir->u.entries[n++] = table[i];
+    }
+    epoch_retire(table, HASH_TABLE_SIZE(capacity));
+    filter_free(dir->filter);
+    dir->filter = NULL;
+}
+
+
+static void hash_to_btree(Directory *dir) {
+    DirEntry *table = dir->u.hash.entries;
+    int capacity = dir->u.hash.capacity;
+
+    dir->kind = DIR_BTREE;
+    btree_init(&dir->u.btree);
+    for (int i = 0; i < capacity; i++) {
+        if (table[i].inumber >= 0)
+            btree_insert(&dir->u.btree, &dir->arena, &table[i]);
+    }
+    epoch_retire(table, HASH_TABLE_SIZE(capacity));
+}
+
+
+static void btree_to_hash(Directory *dir) {
+    Btree tree = dir->u.btree;
+    int pos;
+
+    dir->kind = DIR_HASH;
+    hash_alloc(dir, hash_capacity_for(dir->count));
+    for (BtNode *leaf = btree_seek(&tree, &dir->arena, "", &pos); leaf != NULL; leaf = leaf->u.l.next) {
+        for (int i = 0; i < leaf->n; i++)
+            hash_place(dir, &leaf->u.l.entries[i]);
+    }
+    btree_destroy(&tree);
+}
+
+
+#define DIR_NAME_SIZE(len) (sizeof(DirName) + (len) + 1)
+#define DIR_TABLE_SIZE(capacity) (sizeof(DirTable) + sizeof(DirSlot) * (capacity))
+
+static DirTable *table_alloc(int capacity) {
+    DirTable *table = slab_alloc(DIR_TABLE_SIZE(capacity));
+    table->capacity = capacity;
+    table->claimed = 0;
+    for (int i = 0; i < capacity; i++) {
+        table->slots[i].name = NULL;
+        table->slots[i].inumber = DIR_SLOT_FREE;
+    }
+    return table;
+}
+
+
+static int name_matches(DirName *rec, const char *name, int len, unsigned int hash) {
+    return rec->hash == hash && rec->len == len && memcmp(rec->name, name, len) == 0;
+}
+
+
+/*
+ * Finds the slot that claimed a name in a DIR_CONCURRENT table. Safe against
+ * concurrent inserts and removes.
+ * Returns: the slot, or NULL if no slot holds the name
+ */
+static DirSlot *table_find(DirTable *table, const char *name, int len, unsigned int hash) {
+    int mask = table->capacity - 1;
+    int slot = hash & mask;
+
+    for (int probes = 0; probes < table->capacity; probes++, slot = (slot + 1) & mask) {
+        DirName *rec = __atomic_load_n(&table->slots[slot].name, __ATOMIC_ACQUIRE);
+        if (rec == NULL)
+            return NULL;
+        if (name_matches(rec, name, len, hash))
+            return &table->slots[slot];
+    }
+    return NULL;
+}
+
+
+/* Live inumber of a slot, or FAIL while it is unpublished or removed */
+static int slot_inumber(DirSlot *slot) {
+    int inumber = slot == NULL ? FAIL : __atomic_load_n(&slot->inumber, __ATOMIC_ACQUIRE);
+    return inumber >= 0 ? inumber : FAIL;
+}
+
+
+/*
+ * Adds an entry to a DIR_CONCURRENT directory, concurrently with other
+ * inserts and removes. The first insert to swap its name into a free slot
+ * owns it; an insert that finds its name already claimed may only reuse the
+ * slot if the entry there was removed, and fails otherwise, even if the
+ * owner has not published its inumber yet.
+ * Returns: SUCCESS, FAIL (name exists) or DIR_FULL
+ */
+static int table_insert(Directory *dir, const char *name, int len, unsigned int hash, int inumber) {
+    DirTable *table = dir->u.table;
+    int mask = table->capacity - 1;
+    int slot = hash & mask, result = DIR_FULL;
+    DirName *rec = NULL;
+
+    if (__atomic_load_n(&table->claimed, __ATOMIC_RELAXED) * 4 >= table->capacity * 3)
+        return DIR_FULL;
+
+    for (int probes = 0; probes < table->capacity; probes++, slot = (slot + 1) & mask) {
+        DirSlot *s = &table->slots[slot];
+        DirName *claimed = __atomic_load_n(&s->name, __ATOMIC_ACQUIRE);
+
+        if (claimed == NULL) {
+            if (rec == NULL) {
+                rec = slab_alloc(DIR_NAME_SIZE(len));
+                rec->hash = hash;
+                rec->len = len;
+                memcpy(rec->name, name, len);
+                rec->name[len] = '\0';
+            }
+            if (__atomic_compare_exchange_n(&s->name, &claimed, rec, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_add(&table->claimed, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&dir->count, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->inumber, inumber, __ATOMIC_RELEASE);
+                return SUCCESS;
+            }
+            /* lost the slot, claimed now holds the winner's name */
+        }
+        if (!name_matches(claimed, name, len, hash))
+            continue;
+
+        int removed = DIR_SLOT_DELETED;
+        if (__atomic_compare_exchange_n(&s->inumber, &removed, inumber, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&dir->count, 1, __ATOMIC_RELAXED);
+            result = SUCCESS;
+        }
+        else {
+            result = FAIL;
+        }
+        break;
+    }
+    if (rec != NULL)
+        slab_free(rec, DIR_NAME_SIZE(len));
+    return result;
+}
+
+
+/*
+ * Removes an entry of a DIR_CONCURRENT directory by leaving a tombstone in
+ * its slot, if it still refers to the given inumber.
+ * Returns: SUCCESS or FAIL
+ */
+static int table_remove(Directory *dir, const char *name, int len, unsigned int hash, int inumber) {
+    DirSlot *slot = table_find(dir->u.table, name, len, hash);
+
+    if (slot == NULL || !__atomic_compare_exchange_n(&slot->inumber, &inumber, DIR_SLOT_DELETED, 0,
+                                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return FAIL;
+    __atomic_fetch_sub(&dir->count, 1, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+
+/* Retires a DIR_CONCURRENT table, with the names of removed entries if it is not being rebuilt */
+static void table_free(DirTable *table, int names) {
+    for (int i = 0; i < table->capacity; i++) {
+        DirName *rec = table->slots[i].name;
+        if (rec != NULL && (names || table->slots[i].inumber < 0))
+            epoch_retire(rec, DIR_NAME_SIZE(rec->len));
+    }
+    epoch_retire(table, DIR_TABLE_SIZE(table->capacity));
+}
+
+
+/*
+ * Creates an empty directory for the given inumber.
+ */
+Directory *directory_new(int inumber) {
+    Directory *dir = slab_alloc(sizeof(Directory));
+    dir->kind = DIR_INLINE;
+    dir->count = 0;
+    dir->arena.buf = NULL;
+    dir->arena.size = dir->arena.capacity = dir->arena.garbage = 0;
+    dir->filter = NULL;
+#ifdef DIR_LOCKFREE
+    dir->kind = DIR_CONCURRENT;
+    dir->u.table = table_alloc(DIR_INITIAL_CAPACITY);
+    dir->filter = filter_alloc(DIR_INITIAL_CAPACITY);
+#endif
+#ifdef DIR_GLOBAL_TABLE
+    dir->kind = DIR_GLOBAL;
+    dir->u.global.owner = inumber;
+    dir->u.global.children = NULL;
+#endif
+    return dir;
+}
+
+
+/*
+ * Releases a directory and its entries, once no optimistic lookup can be
+ * reading them.
+ */
+void directory_free(Directory *dir) {
+    if (dir == NULL)
+        return;
+    if (dir->kind == DIR_HASH)
+        epoch_retire(dir->u.hash.entries, HASH_TABLE_SIZE(dir->u.hash.capacity));
+    else if (dir->kind == DIR_BTREE)
+        btree_destroy(&dir->u.btree);
+    else if (dir->kind == DIR_CONCURRENT)
+        table_free(dir->u.table, 1);
+    else if (dir->kind == DIR_GLOBAL)
+        dhash_clear(&dir->u.global.children);
+    filter_free(dir->filter);
+    epoch_retire(dir->arena.buf, dir->arena.capacity);
+    epoch_retire(dir, sizeof(Directory));
+}
+
+
+/*
+ * Looks for an entry by name.
+ * Input:
+ *  - name, len, hash: the name, not necessarily NUL terminated, its length and name_hash
+ * Returns:
+ *  - inumber: of the entry, if found
+ *  - FAIL: if not found
+ */
+int directory_lookup(Directory *dir, const char *name, int len, unsigned int hash) {
+    if (dir == NULL)
+        return FAIL;
+
+    DirFilter *filter = __atomic_load_n(&dir->filter, __ATOMIC_ACQUIRE);
+    /* most misses end here, without reading any entry */
+    if (filter != NULL && !filter_may_contain(filter, hash))
+        return FAIL;
+    switch (dir->kind) {
+        case DIR_INLINE:
+            for (int i = 0; i < dir->count; i++) {
+                if (entry_matches(dir, &dir->u.entries[i], name, len, hash))
+                    return dir->u.entries[i].inumber;
+            }
+            return FAIL;
+        case DIR_HASH: {
+            int slot = hash_find(dir, name, len, hash);
+            return slot == FAIL ? FAIL : dir->u.hash.entries[slot].inumber;
+        }
+        case DIR_BTREE: {
+            DirEntry *entry = btree_lookup(&dir->u.btree, &dir->arena, name, len, hash);
+            return entry == NULL ? FAIL : entry->inumber;
+        }
+        case DIR_CONCURRENT:
+            return slot_inumber(table_find(__atomic_load_n(&dir->u.table, __ATOMIC_ACQUIRE), name, len, hash));
+        case DIR_GLOBAL:
+            return dhash_lookup(dir->u.global.owner, name, len, hash);
+    }
+    return FAIL;
+}
+
+
+void directory_listing_init(DirListing *list) {
+    list->count = list->capacity = 0;
+    list->size = list->namesCapacity = 0;
+    list->inumbers = list->offsets = NULL;
+    list->names = NULL;
+}
+
+
+void directory_listing_free(DirListing *list) {
+    free(list->inumbers);
+    free(list->offsets);
+    free(list->names);
+    directory_listing_init(list);
+}
+
+
+static void listing_add(DirListing *list, const char *name, int len, int inumber) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? DIR_INITIAL_CAPACITY : list->capacity * 2;
+        list->inumbers = realloc(list->inumbers, sizeof(int) * list->capacity);
+        list->offsets = realloc(list->offsets, sizeof(int) * list->capacity);
+    }
+    if (list->size + len + 1 > list->namesCapacity) {
+        list->namesCapacity = list->namesCapacity == 0 ? 256 : list->namesCapacity * 2;
+        while (list->namesCapacity < list->size + len + 1)
+            list->namesCapacity *= 2;
+        list->names = realloc(list->names, list->namesCapacity);
+    }
+    if (list->inumbers == NULL || list->offsets == NULL || list->names == NULL) {
+        fprintf(stderr, "Error: failed to grow directory listing.\n");
+        exit(EXIT_FAILURE);
+    }
+    list->inumbers[list->count] = inumber;
+    list->offsets[list->count] = list->size;
+    memcpy(list->names + list->size, name, len);
+    list->names[list->size + len] = '\0';
+    list->size += len + 1;
+    list->count++;
+}
+
+
+/*
+ * Copies a listing into another, emptied first.
+ */
+void directory_listing_copy(DirListing *dst, const DirListing *src) {
+    dst->count = dst->size = 0;
+    for (int i = 0; i < src->count; i++) {
+        const char *name = DIR_LISTING_NAME(src, i);
+        listing_add(dst, name, strlen(name), src->inumbers[i]);
+    }
+}
+
+
+/* Copies the published entries of a DIR_CONCURRENT table */
+static void table_list(DirTable *table, DirListing *list) {
+    for (int i = 0; i < table->capacity; i++) {
+        DirName *rec = __atomic_load_n(&table->slots[i].name, __ATOMIC_ACQUIRE);
+        int inumber = slot_inumber(&table->slots[i]);
+        if (rec != NULL && inumber != FAIL)
+            listing_add(list, rec->name, rec->len, inumber);
+    }
+}
+
+
+/* Copies the entries of a DIR_GLOBAL directory along their chain */
+static void global_list(DhashEntry *children, DirListing *list) {
+    for (DhashEntry *entry = children; entry != NULL; entry = __atomic_load_n(&entry->sibling, __ATOMIC_ACQUIRE))
+        listing_add(list, entry->name, entry->len, entry->inumber);
+}
+
+
+/*
+ * Copies the live entries of a directory, whose lock the caller holds.
+ */
+void directory_list(Directory *dir, DirListing *list) {
+    DirIter it;
+    DirEntry *entry;
+
+    list->count = list->size = 0;
+    if (dir != NULL && dir->kind == DIR_CONCURRENT) {
+        /* entries can still come and go under a read lock */
+        table_list(dir->u.table, list);
+        return;
+    }
+    if (dir != NULL && dir->kind == DIR_GLOBAL) {
+        global_list(dir->u.global.children, list);
+        return;
+    }
+    directory_iter_init(&it, dir);
+    while ((entry = directory_iter_next(&it)) != NULL)
+        listing_add(list, DIR_ENTRY_NAME(&dir->arena, entry), entry->len, entry->inumber);
+}
+
+
+/*
+ * Optimistic lookups read a directory without its lock, while a writer may
+ * be changing it. Every pointer is only followed once the version of the
+ * directory shows nothing changed since it was read, and names are compared
+ * within the bounds of what was read, so a racing writer can at worst make
+ * the lookup see stale entries, which the caller's final check catches.
+ * Blocks stay allocated meanwhile because they are retired through epochs.
+ */
+
+/* Checks that the directory did not change since its version was seq */
+static int snapshot_valid(const unsigned int *version, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(version, __ATOMIC_RELAXED) == seq;
+}
+
+
+/* Name of a copied entry, or NULL if it does not lie within the arena read */
+static const char *snapshot_name(NameArena *arena, DirEntry *entry) {
+    if (entry->len < DIR_SHORT_NAME)
+        return entry->name.inl;
+    if (entry->name.offset + entry->len >= (unsigned int) arena->size)
+        return NULL;
+    return arena->buf + entry->name.offset;
+}
+
+
+/* Orders names the way strcmp does, without relying on terminators */
+static int snapshot_cmp(const char *a, int alen, const char *b, int blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c != 0 ? c : alen - blen;
+}
+
+
+/*
+ * Compares the name of an entry of a B+tree node against name.
+ * Returns: as strcmp, with *conflict set if the entry could not be read
+ */
+static int snapshot_entry_cmp(NameArena *arena, DirEntry *src, const char *name, int len, int *conflict) {
+    DirEntry entry = *src;
+    const char *entryName = snapshot_name(arena, &entry);
+    if (entryName == NULL) {
+        *conflict = 1;
+        return 0;
+    }
+    return snapshot_cmp(entryName, entry.len, name, len);
+}
+
+
+/* Looks a name up in a single B+tree node, returning the next node in *child */
+static int snapshot_btree_node(BtNode *node, NameArena *arena, const char *name, int len, BtNode **child) {
+    int leaf = node->leaf, n = node->n, conflict = 0;
+    int lo = 0, hi = n;
+
+    if (n < 0 || n > (leaf ? BT_LEAF_MAX : BT_INNER_MAX))
+        return RETRY;
+
+    if (!leaf) {
+        /* index of the child whose range holds name */
+        while (lo < hi && !conflict) {
+            int mid = (lo + hi) / 2;
+            if (snapshot_entry_cmp(arena, &node->u.i.keys[mid], name, len, &conflict) <= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        *child = node->u.i.children[lo];
+        return conflict ? RETRY : SUCCESS;
+    }
+
+    while (lo < hi && !conflict) {
+        int mid = (lo + hi) / 2;
+        if (snapshot_entry_cmp(arena, &node->u.l.entries[mid], name, len, &conflict) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *child = NULL;
+    if (conflict)
+        return RETRY;
+    if (lo < n) {
+        DirEntry entry = node->u.l.entries[lo];
+        const char *entryName = snapshot_name(arena, &entry);
+        if (entryName == NULL)
+            return RETRY;
+        if (snapshot_cmp(entryName, entry.len, name, len) == 0)
+            return entry.inumber;
+    }
+    return FAIL;
+}
+
+
+/*
+ * Looks for an entry by name without holding the directory's lock.
+ * Input:
+ *  - dir: directory read while its version was seq
+ *  - version: the directory's version counter
+ * Returns:
+ *  - inumber: of the entry, if found
+ *  - FAIL: if not found
+ *  - RETRY: if a writer changed the directory
+ */
+int directory_lookup_optimistic(Directory *dir, const char *name, int len, unsigned int hash,
+                                const unsigned int *version, unsigned int seq) {
+    int result = FAIL;
+
+    dirKind kind = dir->kind;
+    int count = dir->count;
+    NameArena arena = dir->arena;
+    DirEntry *entries = dir->u.hash.entries;
+    int capacity = dir->u.hash.capacity;
+    BtNode *node = dir->u.btree.root;
+    DirTable *table = __atomic_load_n(&dir->u.table, __ATOMIC_ACQUIRE);
+    int owner = dir->u.global.owner;
+    DirFilter *filter = __atomic_load_n(&dir->filter, __ATOMIC_ACQUIRE);
+    if (!snapshot_valid(version, seq))
+        return RETRY;
+
+    if (kind != DIR_INLINE && filter != NULL && !filter_may_contain(filter, hash))
+        return snapshot_valid(version, seq) ? FAIL : RETRY;
+
+    switch (kind) {
+        case DIR_INLINE:
+            for (int i = 0; i < count && i < DIR_INLINE_MAX; i++) {
+                DirEntry entry = dir->u.entries[i];
+                if (entry.hash != hash || entry.len != len)
+                    continue;
+                const char *entryName = snapshot_name(&arena, &entry);
+                if (entryName == NULL)
+                    return RETRY;
+                if (memcmp(entryName, name, len) == 0) {
+                    result = entry.inumber;
+                    break;
+                }
+            }
+            break;
+        case DIR_HASH: {
+            int mask = capacity - 1;
+            int slot = hash & mask;
+            for (int probes = 0; probes < capacity; probes++, slot = (slot + 1) & mask) {
+                DirEntry entry = entries[slot];
+                if (entry.inumber == DIR_SLOT_FREE)
+                    break;
+                if (entry.inumber < 0 || entry.hash != hash || entry.len != len)
+                    continue;
+                const char *entryName = snapshot_name(&arena, &entry);
+                if (entryName == NULL)
+                    return RETRY;
+                if (memcmp(entryName, name, len) == 0) {
+                    result = entry.inumber;
+                    break;
+                }
+            }
+            break;
+        }
+        case DIR_BTREE:
+            while (node != NULL) {
+                BtNode *child;
+                result = snapshot_btree_node(node, &arena, name, len, &child);
+                if (result == RETRY || !snapshot_valid(version, seq))
+                    return RETRY;
+                node = child;
+            }
+            break;
+        case DIR_CONCURRENT:
+            /* slots are read atomically, the version only changes when the table is rebuilt */
+            result = slot_inumber(table_find(table, name, len, hash));
+            break;
+        case DIR_GLOBAL:
+            result = dhash_lookup(owner, name, len, hash);
+            break;
+    }
+    return snapshot_valid(version, seq) ? result : RETRY;
+}
+
+
+/* Copies one live entry of a snapshot to the listing, or returns RETRY if its name is out of the arena */
+static int snapshot_list_entry(NameArena *arena, DirEntry *src, DirListing *list) {
+    DirEntry entry = *src;
+    const char *entryName = snapshot_name(arena, &entry);
+    if (entryName == NULL || entry.len >= MAX_FILE_NAME)
+        return RETRY;
+    listing_add(list, entryName, entry.len, entry.inumber);
+    return SUCCESS;
+}
+
+
+/*
+ * Copies the live entries of a directory without holding its lock, in the
+ * order directory_iter_next would return them.
+ * Input:
+ *  - dir: directory read while its version was seq
+ *  - list: listing to fill, emptied first
+ *  - version: the directory's version counter
+ * Returns: SUCCESS, or RETRY if a writer changed the directory
+ */
+int directory_list_optimistic(Directory *dir, DirListing *list, const unsigned int *version, unsigned int seq) {
+    list->count = list->size = 0;
+
+    dirKind kind = dir->kind;
+    int count = dir->count;
+    NameArena arena = dir->arena;
+    DirEntry *entries = dir->u.hash.entries;
+    int capacity = dir->u.hash.capacity;
+    BtNode *node = dir->u.btree.root;
+    DirTable *table = __atomic_load_n(&dir->u.table, __ATOMIC_ACQUIRE);
+    DhashEntry *children = __atomic_load_n(&dir->u.global.children, __ATOMIC_ACQUIRE);
+    if (!snapshot_valid(version, seq))
+        return RETRY;
+
+    switch (kind) {
+        case DIR_INLINE:
+            for (int i = 0; i < count && i < DIR_INLINE_MAX; i++) {
+                if (snapshot_list_entry(&arena, &dir->u.entries[i], list) == RETRY)
+                    return RETRY;
+            }
+            break;
+        case DIR_HASH:
+            for (int i = 0; i < capacity; i++) {
+                if (entries[i].inumber >= 0 && snapshot_list_entry(&arena, &entries[i], list) == RETRY)
+                    return RETRY;
+            }
+            break;
+        case DIR_BTREE:
+            /* down to the first leaf, then along the leaf chain */
+            while (node != NULL && !node->leaf) {
+                BtNode *child = node->u.i.children[0];
+                if (!snapshot_valid(version, seq))
+                    return RETRY;
+                node = child;
+            }
+            while (node != NULL) {
+                int n = node->n;
+                if (n < 0 || n > BT_LEAF_MAX)
+                    return RETRY;
+                for (int i = 0; i < n; i++) {
+                    if (snapshot_list_entry(&arena, &node->u.l.entries[i], list) == RETRY)
+                        return RETRY;
+                }
+                BtNode *next = node->u.l.next;
+                if (!snapshot_valid(version, seq))
+                    return RETRY;
+                node = next;
+            }
+            break;
+        case DIR_CONCURRENT:
+            table_list(table, list);
+            break;
+        case DIR_GLOBAL:
+            /* removed entries still lead back into the chain, and are retired through epochs */
+            global_list(children, list);
+            break;
+    }
+    return snapshot_valid(version, seq) ? SUCCESS : RETRY;
+}
+
+
+/*
+ * Adds an entry, copying its name. The name must not exist in the directory
+ * yet, except in a DIR_CONCURRENT directory, where an existing name makes
+ * the insert fail.
+ * Input:
+ *  - name, len, hash: as for directory_lookup
+ * Returns: SUCCESS, FAIL, or DIR_FULL if the directory must be rebuilt first
+ */
+int directory_insert(Directory *dir, const char *name, int len, unsigned int hash, int inumber) {
+    DirEntry entry;
+
+    if (len >= MAX_FILE_NAME)
+        return FAIL;
+    if (dir->kind == DIR_CONCURRENT) {
+        /* in the filter before lookups can find it in the table */
+        filter_add(dir->filter, hash);
+        return table_insert(dir, name, len, hash, inumber);
+    }
+    if (dir->kind == DIR_GLOBAL) {
+        if (dhash_insert(&dir->u.global.children, dir->u.global.owner, name, len, hash, inumber) == FAIL)
+            return FAIL;
+        dir->count++;
+        return SUCCESS;
+    }
+    entry_set(dir, &entry, name, len, hash, inumber);
+
+    if (dir->kind == DIR_INLINE && dir->count == DIR_INLINE_MAX)
+        inline_to_hash(dir);
+    else if (dir->kind == DIR_HASH && dir->count == DIR_BTREE_MIN)
+        hash_to_btree(dir);
+
+    switch (dir->kind) {
+        case DIR_INLINE:
+            dir->u.entries[dir->count] = entry;
+            break;
+        case DIR_HASH:
+            /* keep the load factor, tombstones included, under 3/4 */
+            if ((dir->u.hash.used + 1) * 4 > dir->u.hash.capacity * 3) {
+                int capacity = dir->u.hash.capacity;
+                if ((dir->count + 1) * 2 > capacity)
+                    capacity *= 2;
+                hash_rehash(dir, capacity);
+            }
+            hash_place(dir, &entry);
+            break;
+        case DIR_BTREE:
+            if (btree_insert(&dir->u.btree, &dir->arena, &entry) == FAIL) {
+                entry_release(dir, len);
+                return FAIL;
+            }
+            break;
+        case DIR_CONCURRENT:
+        case DIR_GLOBAL:
+            break;
+    }
+    dir->count++;
+
+    if (dir->kind != DIR_INLINE && (dir->filter == NULL || dir->count > dir->filter->entries))
+        filter_rebuild(dir, dir->count * 2);
+    else if (dir->kind != DIR_INLINE)
+        filter_add(dir->filter, entry.hash);
+    return SUCCESS;
+}
+
+
+/*
+ * Removes the entry with the given name, if it refers to the given inumber.
+ * Input:
+ *  - name, len, hash: as for directory_lookup
+ * Returns: SUCCESS or FAIL
+ */
+int directory_remove(Directory *dir, const char *name, int len, unsigned int hash, int inumber) {
+    switch (dir->kind) {
+        case DIR_INLINE: {
+            int i = 0;
+            while (i < dir->count && !entry_matches(dir, &dir->u.entries[i], name, len, hash))
+                i++;
+            if (i == dir->count || dir->u.entries[i].inumber != inumber)
+                return FAIL;
+            /* keep the entries packed */
+            dir->u.entries[i] = dir->u.entries[dir->count - 1];
+            dir->count--;
+            entry_release(dir, len);
+            return SUCCESS;
+        }
+        case DIR_HASH: {
+            int slot = hash_find(dir, name, len, hash);
+            int mask = dir->u.hash.capacity - 1;
+            if (slot == FAIL || dir->u.hash.entries[slot].inumber != inumber)
+                return FAIL;
+
+            /* a tombstone is only needed if a probe sequence continues past the slot */
+            if (dir->u.hash.entries[(slot + 1) & mask].inumber == DIR_SLOT_FREE) {
+                dir->u.hash.entries[slot].inumber = DIR_SLOT_FREE;
+                hash_set_tag(dir, slot, TAG_FREE);
+                dir->u.hash.used--;
+            }
+            else {
+                dir->u.hash.entries[slot].inumber = DIR_SLOT_DELETED;
+                hash_set_tag(dir, slot, TAG_DELETED);
+            }
+            dir->count--;
+            entry_release(dir, len);
+            filter_removed(dir);
+
+            if (dir->count <= DIR_INLINE_MAX / 2)
+                hash_to_inline(dir);
+            else if (dir->u.hash.capacity > DIR_INITIAL_CAPACITY && dir->count * 8 < dir->u.hash.capacity)
+                hash_rehash(dir, dir->u.hash.capacity / 2);
+            return SUCCESS;
+        }
+        case DIR_BTREE:
+            if (btree_remove(&dir->u.btree, &dir->arena, name, len, inumber) == FAIL)
+                return FAIL;
+            dir->count--;
+            entry_release(dir, len);
+            filter_removed(dir);
+            if (dir->count < DIR_BTREE_MIN / 4)
+                btree_to_hash(dir);
+            return SUCCESS;
+        case DIR_CONCURRENT:
+            return table_remove(dir, name, len, hash, inumber);
+        case DIR_GLOBAL:
+            if (dhash_remove(&dir->u.global.children, dir->u.global.owner, name, len, hash, inumber) == FAIL)
+                return FAIL;
+            dir->count--;
+            return SUCCESS;
+    }
+    return FAIL;
+}
+
+
+/*
+ * Returns the number of live entries.
+ */
+int directory_count(Directory *dir) {
+    return dir == NULL ? 0 : __atomic_load_n(&dir->count, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Tells whether a DIR_CONCURRENT directory has claimed half of its slots,
+ * and should be rebuilt before inserts start failing with DIR_FULL.
+ */
+int directory_needs_rebuild(Directory *dir) {
+    if (dir == NULL || dir->kind != DIR_CONCURRENT)
+        return 0;
+    DirTable *table = dir->u.table;
+    return __atomic_load_n(&table->claimed, __ATOMIC_RELAXED) * 2 >= table->capacity;
+}
+
+
+/*
+ * Moves the live entries of a DIR_CONCURRENT directory to a new table that
+ * keeps them under a quarter load, dropping removed names. No other insert
+ * or remove may run meanwhile; optimistic readers may keep reading the old
+ * table, which is retired.
+ */
+void directory_rebuild(Directory *dir) {
+    DirTable *old = dir->u.table;
+    DirTable *table = table_alloc(hash_capacity_for(dir->count * 2));
+    int mask = table->capacity - 1;
+
+    for (int i = 0; i < old->capacity; i++) {
+        if (old->slots[i].name == NULL || old->slots[i].inumber < 0)
+            continue;
+        int slot = old->slots[i].name->hash & mask;
+        while (table->slots[slot].name != NULL)
+            slot = (slot + 1) & mask;
+        table->slots[slot] = old->slots[i];
+        table->claimed++;
+    }
+    __atomic_store_n(&dir->u.table, table, __ATOMIC_RELEASE);
+    table_free(old, 0);
+    /* inserts fail with DIR_FULL before the table is 3/4 claimed, so the filter is never outgrown */
+    filter_rebuild(dir, table->capacity);
+}
+
+
+/*
+ * Returns the name of an entry of the directory.
+ */
+const char *directory_entry_name(Directory *dir, DirEntry *entry) {
+    return DIR_ENTRY_NAME(&dir->arena, entry);
+}
+
+
+void directory_iter_init(DirIter *it, Directory *dir) {
+    directory_iter_range(it, dir, NULL, NULL);
+}
+
+
+/*
+ * Starts an iteration over the entries with names in [from, to). Either
+ * bound may be NULL.
+ */
+void directory_iter_range(DirIter *it, Directory *dir, const char *from, const char *to) {
+    it->dir = dir;
+    it->pos = 0;
+    it->from = from;
+    it->to = to;
+    it->leaf = NULL;
+    if (dir != NULL && (dir->kind == DIR_CONCURRENT || dir->kind == DIR_GLOBAL))
+        it->dir = NULL;
+    if (dir != NULL && dir->kind == DIR_BTREE)
+        it->leaf = btree_seek(&dir->u.btree, &dir->arena, from != NULL ? from : "", &it->pos);
+}
+
+
+static int iter_in_range(DirIter *it, DirEntry *entry) {
+    const char *name = DIR_ENTRY_NAME(&it->dir->arena, entry);
+    return (it->from == NULL || strcmp(name, it->from) >= 0)
+        && (it->to == NULL || strcmp(name, it->to) < 0);
+}
+
+
+/*
+ * Returns the next live entry, or NULL at the end of the directory.
+ */
+DirEntry *directory_iter_next(DirIter *it) {
+    Directory *dir = it->dir;
+    DirEntry *entry;
+
+    if (dir == NULL)
+        return NULL;
+
+    switch (dir->kind) {
+        case DIR_INLINE:
+            while (it->pos < dir->count) {
+                entry = &dir->u.entries[it->pos++];
+                if (iter_in_range(it, entry))
+                    return entry;
+            }
+            break;
+        case DIR_HASH:
+            while (it->pos < dir->u.hash.capacity) {
+                entry = &dir->u.hash.entries[it->pos++];
+                if (entry->inumber >= 0 && iter_in_range(it, entry))
+                    return entry;
+            }
+            break;
+        case DIR_BTREE:
+            /* leaves are sorted, so the first name past the range ends it */
+            while (it->leaf != NULL) {
+                if (it->pos < it->leaf->n) {
+                    entry = &it->leaf->u.l.entries[it->pos++];
+                    if (it->to != NULL && strcmp(DIR_ENTRY_NAME(&dir->arena, entry), it->to) >= 0)
+                        it->leaf = NULL;
+                    else
+                        return entry;
+                }
+                else {
+                    it->leaf = it->leaf->u.l.next;
+                    it->pos = 0;
+                }
+            }
+            break;
+        case DIR_CONCURRENT:
+        case DIR_GLOBAL:
+            break;
+    }
+    return NULL;
+}
@@ -0,0 +1,211 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include "../../tecnicofs-api-constants.h"
+
+/* Entries kept inside the Directory itself, before a hash table is needed */
+#define DIR_INLINE_MAX 8
+/* Hash table size when a directory outgrows the inline entries, a power of two */
+#define DIR_INITIAL_CAPACITY 16
+/* Directories with more entries are kept in a B+tree, which is ordered */
+#define DIR_BTREE_MIN 4096
+
+/* Names shorter than this are stored in the entry itself */
+#define DIR_SHORT_NAME 15
+/* Removed long names are compacted away once they take this much of an arena */
+#define DIR_ARENA_MIN_GARBAGE 4096
+
+/*
+ * Directories past DIR_INLINE_MAX entries keep a Bloom filter of their names,
+ * with DIR_FILTER_BITS bits per entry it is sized for and DIR_FILTER_PROBES
+ * bits set per name, all in one 64 byte block
+ */
+#define DIR_FILTER_BITS 8
+#define DIR_FILTER_PROBES 3
+#define DIR_FILTER_MIN_ENTRIES 64
+
+/* FNV-1a, the hash of entry names, one character at a time */
+#define NAME_HASH_INIT 2166136261u
+#define NAME_HASH_STEP(hash, c) (((hash) ^ (unsigned char) (c)) * 16777619u)
+
+/* Slot states, stored in DirEntry.inumber */
+#define DIR_SLOT_FREE -1
+#define DIR_SLOT_DELETED -2
+
+/* directory_insert into a DIR_CONCURRENT directory whose table must be rebuilt first */
+#define DIR_FULL -3
+
+#if defined(DIR_LOCKFREE) && defined(DIR_GLOBAL_TABLE)
+#error "DIR_GLOBAL_TABLE directories are changed under their write lock, it can't be built with DIR_LOCKFREE"
+#endif
+
+/*
+ * Contains the name of the entry, its hash and length, and respective
+ * i-number. Names of DIR_SHORT_NAME or more characters are kept in the name
+ * arena of the directory, so every entry takes 24 bytes.
+ */
+typedef struct dirEntry {
+	unsigned int hash;
+	int inumber;
+	unsigned char len;
+	union {
+		char inl[DIR_SHORT_NAME]; /* len < DIR_SHORT_NAME */
+		unsigned int offset;      /* in the name arena otherwise */
+	} __attribute__((packed)) name;
+} DirEntry;
+
+/*
+ * Long names of a directory, stored one after the other. Removed names are
+ * left in place until the arena is compacted.
+ */
+typedef struct nameArena {
+	char *buf;
+	int size;     /* bytes used, removed names included */
+	int capacity;
+	int garbage;  /* bytes of removed names */
+} NameArena;
+
+#define DIR_ENTRY_NAME(arena, entry) \
+	((entry)->len < DIR_SHORT_NAME ? (entry)->name.inl : (arena)->buf + (entry)->name.offset)
+
+typedef enum dirKind { DIR_INLINE, DIR_HASH, DIR_BTREE, DIR_CONCURRENT, DIR_GLOBAL } dirKind;
+
+/*
+ * Name of an entry of a DIR_CONCURRENT directory. A slot keeps the name it
+ * claimed until its table is rebuilt, so a name never changes under a reader.
+ */
+typedef struct dirName {
+	unsigned int hash;
+	unsigned char len;
+	char name[];
+} DirName;
+
+typedef struct dirSlot {
+	DirName *name; /* NULL while the slot is free */
+	int inumber;   /* DIR_SLOT_FREE until published, DIR_SLOT_DELETED once removed */
+} DirSlot;
+
+typedef struct dirTable {
+	int capacity; /* number of slots, a power of two */
+	int claimed;  /* slots with a name, removed entries included */
+	DirSlot slots[];
+} DirTable;
+
+/*
+ * Bloom filter of the names of a directory: a name that is not in the
+ * filter is not in the directory. Names removed stay in it until it is
+ * rebuilt, which happens once they outnumber the live entries, or once the
+ * directory outgrows what it was sized for.
+ */
+typedef struct dirFilter {
+	int blocks;   /* of 512 bits, a power of two */
+	int entries;  /* sized for */
+	int removed;  /* names removed since it was built */
+	unsigned long words[];
+} DirFilter;
+
+struct btNode;
+struct dhashEntry;
+
+typedef struct btree {
+	struct btNode *root;
+} Btree;
+
+/*
+ * A directory changes representation with its size:
+ *  - DIR_INLINE: up to DIR_INLINE_MAX entries packed in the Directory itself
+ *  - DIR_HASH: open addressing hash table indexed by name hash with linear
+ *    probing, where deleted slots are tombstones until the next rehash. The
+ *    tag of every slot is kept in a packed array after the entries, so a
+ *    probe sequence is read a group of slots at a time (see tags.h)
+ *  - DIR_BTREE: B+tree sorted by name, for ordered and range iteration
+ * Shrinking directories go back to a smaller representation once they
+ * fall well under the threshold that promoted them.
+ *
+ * Built with -DDIR_LOCKFREE, every directory is instead a DIR_CONCURRENT
+ * hash table that entries are added to and removed from concurrently: an
+ * insert claims a free slot by compare-and-swap on its name and then
+ * publishes the inumber, a remove swaps the inumber for a tombstone. A name
+ * is only ever claimed by one slot of a table, so two inserts of the same
+ * name meet on that slot and one of them fails. The table is only rebuilt,
+ * larger and without removed names, by a caller that excludes every other
+ * writer of the directory.
+ *
+ * Built with -DDIR_GLOBAL_TABLE, every directory is instead DIR_GLOBAL: its
+ * entries live in one hash table shared by all directories, keyed by the
+ * directory's inumber and the name, and are chained to each other for
+ * listings (see dhash.h).
+ */
+typedef struct directory {
+	dirKind kind;
+	int count; /* live entries */
+	NameArena arena;
+	DirFilter *filter; /* NULL for DIR_INLINE and DIR_GLOBAL */
+	union {
+		DirEntry entries[DIR_INLINE_MAX];
+		struct {
+			int used;     /* live entries plus tombstones */
+			int capacity; /* number of slots */
+			DirEntry *entries;
+			unsigned short *tags; /* capacity + TAG_GROUP, the first TAG_GROUP repeated at the end */
+		} hash;
+		Btree btree;
+		DirTable *table;
+		struct {
+			int owner; /* inumber of the directory */
+			struct dhashEntry *children;
+		} global;
+	} u;
+} Directory;
+
+/*
+ * Iterator over the live entries of a directory, optionally limited to
+ * names in [from, to). Entries come in name order for DIR_BTREE only.
+ * DIR_CONCURRENT and DIR_GLOBAL directories have no DirEntry and are read
+ * through directory_list instead.
+ */
+typedef struct dirIter {
+	Directory *dir;
+	int pos;
+	struct btNode *leaf;
+	const char *from, *to;
+} DirIter;
+
+/*
+ * Names and inumbers of the live entries of a directory, in iteration
+ * order. Names are packed one after the other in a single buffer.
+ */
+typedef struct dirListing {
+	int count;
+	int capacity;
+	int *inumbers;
+	int *offsets;
+	char *names;
+	int size;         /* bytes used in names */
+	int namesCapacity;
+} DirListing;
+
+#define DIR_LISTING_NAME(list, i) ((list)->names + (list)->offsets[i])
+
+unsigned int name_hash(const char *name);
+Directory *directory_new(int inumber);
+void directory_free(Directory *dir);
+int directory_lookup(Directory *dir, const char *name, int len, unsigned int hash);
+int directory_lookup_optimistic(Directory *dir, const char *name, int len, unsigned int hash,
+                                const unsigned int *version, unsigned int seq);
+int directory_insert(Directory *dir, const char *name, int len, unsigned int hash, int inumber);
+int directory_remove(Directory *dir, const char *name, int len, unsigned int hash, int inumber);
+int directory_count(Directory *dir);
+int directory_needs_rebuild(Directory *dir);
+void directory_rebuild(Directory *dir);
+const char *directory_entry_name(Directory *dir, DirEntry *entry);
+void directory_iter_init(DirIter *it, Directory *dir);
+void directory_iter_range(DirIter *it, Directory *dir, const char *from, const char *to);
+DirEntry *directory_iter_next(DirIter *it);
+void directory_listing_init(DirListing *list);
+void directory_listing_free(DirListing *list);
+void directory_listing_copy(DirListing *dst, const DirListing *src);
+void directory_list(Directory *dir, DirListing *list);
+int directory_list_optimistic(Directory *dir, DirListing *list, const unsigned int *version, unsigned int seq);
+
+#endif /* DIR_H */
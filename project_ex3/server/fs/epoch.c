@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "slab.h"
+#include "state.h"
+
+/*
+ * Epoch based reclamation for blocks and i-nodes that readers may access
+ * without locks. Readers announce the global epoch they entered in; what is
+ * retired in epoch e is only released once the global epoch reaches e + 2,
+ * which requires every reader active in e to have left.
+ */
+
+typedef struct retired {
+    void (*release)(void *ptr, size_t size);
+    void *ptr;
+    size_t size;
+} retired;
+
+/* Blocks retired by one worker in one epoch */
+typedef struct epochBag {
+    unsigned long epoch;
+    int count;
+    int capacity;
+    retired *blocks;
+} epochBag;
+
+typedef struct epochRecord {
+    unsigned long state; /* (epoch << 1) | 1 while in a read section, 0 otherwise */
+    int depth;           /* read sections entered and not left, they nest */
+    long retires;
+    long reclaimed;
+    epochBag bags[EPOCH_BAGS];
+    struct epochRecord *next; /* all records, so advancing can check every reader */
+} __attribute__((aligned(CACHE_LINE_SIZE))) epochRecord;
+
+unsigned long global_epoch = 0;
+epochRecord *epoch_records = NULL; /* pushed under records_mutex, read without it */
+pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread epochRecord *thread_record = NULL;
+
+long epoch_advances = 0;
+
+
+/* Returns the calling worker's record, registering it on first use */
+static epochRecord *epoch_record() {
+    if (thread_record != NULL)
+        return thread_record;
+
+    epochRecord *rec;
+    if (posix_memalign((void **) &rec, CACHE_LINE_SIZE, sizeof(epochRecord)) != 0) {
+        fprintf(stderr, "Error: failed to allocate epoch record.\n");
+        exit(EXIT_FAILURE);
+    }
+    rec->state = 0;
+    rec->depth = 0;
+    rec->retires = rec->reclaimed = 0;
+    for (int i = 0; i < EPOCH_BAGS; i++) {
+        rec->bags[i].epoch = 0;
+        rec->bags[i].count = rec->bags[i].capacity = 0;
+        rec->bags[i].blocks = NULL;
+    }
+
+    pthread_mutex_lock(&records_mutex);
+    rec->next = epoch_records;
+    __atomic_store_n(&epoch_records, rec, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&records_mutex);
+
+    thread_record = rec;
+    return rec;
+}
+
+
+/* Releases everything retired in a bag */
+static void epoch_bag_free(epochRecord *rec, epochBag *bag) {
+    for (int i = 0; i < bag->count; i++)
+        bag->blocks[i].release(bag->blocks[i].ptr, bag->blocks[i].size);
+    rec->reclaimed += bag->count;
+    bag->count = 0;
+}
+
+
+/*
+ * Moves the global epoch forward if every active reader has entered in
+ * the current one.
+ */
+static void epoch_try_advance() {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (epochRecord *rec = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != epoch)
+            return;
+    }
+    if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        __atomic_fetch_add(&epoch_advances, 1, __ATOMIC_RELAXED);
+}
+
+
+void epoch_init() {
+    global_epoch = 0;
+    epoch_advances = 0;
+}
+
+
+/*
+ * Frees every retired block. No reader may be active.
+ */
+void epoch_destroy() {
+    while (epoch_records != NULL) {
+        epochRecord *rec = epoch_records;
+        epoch_records = rec->next;
+        for (int i = 0; i < EPOCH_BAGS; i++) {
+            epoch_bag_free(rec, &rec->bags[i]);
+            free(rec->bags[i].blocks);
+        }
+        free(rec);
+    }
+    thread_record = NULL;
+}
+
+
+/*
+ * Starts a read section: blocks reachable from now on stay allocated until
+ * epoch_exit. A section entered inside another one ends with the outer one.
+ */
+void epoch_enter() {
+    epochRecord *rec = epoch_record();
+
+    if (rec->depth++ > 0)
+        return;
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&rec->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+    /* the announcement must be visible before any shared block is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void epoch_exit() {
+    epochRecord *rec = epoch_record();
+
+    if (--rec->depth == 0)
+        __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Calls release(ptr, size) once no reader can still hold what it releases,
+ * from the same worker. It must already be unreachable for new readers.
+ */
+void epoch_retire_with(void (*release)(void *ptr, size_t size), void *ptr, size_t size) {
+    epochRecord *rec = epoch_record();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    /* bags two or more epochs old can no longer be seen by any reader */
+    for (int i = 0; i < EPOCH_BAGS; i++) {
+        if (rec->bags[i].count > 0 && rec->bags[i].epoch + 2 <= epoch)
+            epoch_bag_free(rec, &rec->bags[i]);
+    }
+
+    epochBag *bag = &rec->bags[epoch % EPOCH_BAGS];
+    bag->epoch = epoch;
+    if (bag->count == bag->capacity) {
+        bag->capacity = bag->capacity == 0 ? EPOCH_ADVANCE_INTERVAL : bag->capacity * 2;
+        bag->blocks = realloc(bag->blocks, sizeof(retired) * bag->capacity);
+        if (bag->blocks == NULL) {
+            fprintf(stderr, "Error: failed to grow epoch bag.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bag->blocks[bag->count].release = release;
+    bag->blocks[bag->count].ptr = ptr;
+    bag->blocks[bag->count].size = size;
+    bag->count++;
+
+    if (++rec->retires % EPOCH_ADVANCE_INTERVAL == 0)
+        epoch_try_advance();
+}
+
+
+/*
+ * Frees a slab block of the given size once no reader can still hold it.
+ */
+void epoch_retire(void *ptr, size_t size) {
+    if (ptr != NULL)
+        epoch_retire_with(slab_free, ptr, size);
+}
+
+
+/*
+ * Prints how many blocks were retired and how many were already freed.
+ */
+void epoch_print_stats(FILE *fp) {
+    long retires = 0, reclaimed = 0;
+
+    pthread_mutex_lock(&records_mutex);
+    for (epochRecord *rec = epoch_records; rec != NULL; rec = rec->next) {
+        retires += __atomic_load_n(&rec->retires, __ATOMIC_RELAXED);
+        reclaimed += __atomic_load_n(&rec->reclaimed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&records_mutex);
+    fprintf(fp, "epoch reclamation: epoch %lu (%ld advances), %ld blocks retired, %ld freed\n",
+            __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), epoch_advances, retires, reclaimed);
+}
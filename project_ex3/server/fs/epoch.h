@@ -0,0 +1,20 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Epochs a retired object waits for; bags are kept for every epoch still pending */
+#define EPOCH_BAGS 3
+/* Retires between attempts to advance the global epoch */
+#define EPOCH_ADVANCE_INTERVAL 64
+
+void epoch_init();
+void epoch_destroy();
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, size_t size);
+void epoch_retire_with(void (*release)(void *ptr, size_t size), void *ptr, size_t size);
+void epoch_print_stats(FILE *fp);
+
+#endif /* EPOCH_H */
@@ -1,43 +1,29 @@
 #include "operations.h"
+#include "epoch.h"
+#include "sync.h"
+#include "dcache.h"
+#include "path.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-
-/* Given a path, fills pointers with strings for the parent path and child
- * file name
- * Input:
- *  - path: the path to split. ATENTION: the function may alter this parameter
- *  - parent: reference to a char*, to store parent path
- *  - child: reference to a char*, to store child file name
+/*
+ * Create and delete hold the parent in upgradable mode while they check it,
+ * so lookups through it go on, and upgrade it to write mode once they know
+ * they will change it. With DIR_LOCKFREE, entries are added and removed with
+ * atomic operations, so they only need the parent's read lock.
  */
-void split_parent_child_from_path(char * path, char ** parent, char ** child) {
-
-	int n_slashes = 0, last_slash_location = 0;
-	int len = strlen(path);
-
-	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
-		path[len-1] = '\0';
-	}
-
-	for (int i=0; i < len; ++i) {
-		if (path[i] == '/' && path[i+1] != '\0') {
-			last_slash_location = i;
-			n_slashes++;
-		}
-	}
+#ifdef DIR_LOCKFREE
+#define PARENT_MODE LOCK_MODE_READ
+#else
+#define PARENT_MODE LOCK_MODE_UPGRADE
+#endif
 
-	if (n_slashes == 0) { // root directory
-		*parent = "";
-		*child = path;
-		return;
-	}
-
-	path[last_slash_location] = '\0';
-	*parent = path;
-	*child = path + last_slash_location + 1;
-}
+/*
+ * Moves between directories are serialized, so no other move can put a
+ * directory under the one being moved while its ancestry is checked.
+ */
+static pthread_mutex_t rename_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*
@@ -45,6 +31,7 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
  */
 void init_fs() {
 	inode_table_init();
+	dcache_init();
 	
 	/* create root inode */
 	int root = inode_create(T_DIRECTORY);
@@ -67,18 +54,13 @@ void destroy_fs() {
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns: SUCCESS or FAIL
  */
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL || directory_count(dir) != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -86,173 +68,239 @@ int is_dir_empty(DirEntry *dirEntries) {
 /*
  * Looks for node in directory entry from name.
  * Input:
- *  - name: path of node
- *  - entries: entries of directory
+ *  - path, i: the name is the i-th component of path
+ *  - dir: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
+int lookup_sub_node(const Path *path, int i, Directory *dir) {
+	return directory_lookup(dir, PATH_NAME(path, i), PATH_LEN(path, i), PATH_HASH(path, i));
+}
 
-	if (entries == NULL) {
-		return FAIL;
-	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+
+/*
+ * Adds an entry to a directory whose write lock the caller holds, rebuilding
+ * it first if it has grown too full for lock-free inserts.
+ * Returns: SUCCESS or FAIL
+ */
+static int add_entry_locked(int parent_inumber, int child_inumber, const Path *path, int i) {
+	dir_rebuild(parent_inumber);
+	return dir_add_entry(parent_inumber, child_inumber, PATH_NAME(path, i), PATH_LEN(path, i), PATH_HASH(path, i));
 }
 
 
 /*
- * Creates a new node given a path.
+ * Creates a new node given a path, leaving the locks it takes held.
  * Input:
- *  - name: path of node
+ *  - path: parsed path of node, at least one component deep
  *  - nodeType: type of node
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS, FAIL or RETRY
  */
-int create(char *name, type nodeType){
+static int create_locked(const Path *path, type nodeType){
 
-	pthread_rwlock_t *lockList[INODE_TABLE_SIZE] = {NULL};
-
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, result;
+	int child = path->depth - 1, parent_len = path_parent_len(path);
 	/* use for copy */
 	type pType;
 	union Data pdata;
 
-	strcpy(name_copy, name);
-	
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
-	
-	parent_inumber = lookup(parent_name, lockList);
+	/* Parent is left locked, in upgradable mode unless entries are added lock-free, and its ancestors unlocked */
+	parent_inumber = lookup_coupled(path, child, PARENT_MODE, INTENT_IX);
 
+	if (parent_inumber == RETRY)
+		return RETRY;
 	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n",
-		        name, parent_name);
-		lockListClear(lockList);
+		printf("failed to create %s, invalid parent dir %.*s\n",
+		        path->str, parent_len, path->str);
 		return FAIL;
 	}
 
-	/* Parent is already locked in read mode due to the lookup */
-	lockListSwitchToWr(parent_inumber, lockList);
-	inode_get(parent_inumber, &pType, &pdata);
-
-	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);
-		lockListClear(lockList);
+	if(inode_get(parent_inumber, &pType, &pdata) == FAIL || pType != T_DIRECTORY) {
+		printf("failed to create %s, parent %.*s is not a dir\n",
+		        path->str, parent_len, path->str);
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
-		       child_name, parent_name);
-		lockListClear(lockList);
+	if (dir_needs_rebuild(parent_inumber)) {
+		/* the parent is rebuilt with no other create inside */
+		if ((result = lockListUpgrade(parent_inumber)) != SUCCESS)
+			return result;
+		dir_rebuild(parent_inumber);
+	}
+
+	if (lookup_sub_node(path, child, pdata.dir) != FAIL) {
+		printf("failed to create %.*s, already exists in dir %.*s\n",
+		       PATH_LEN(path, child), PATH_NAME(path, child), parent_len, path->str);
 		return FAIL;
 	}
 
+	/* no other create or delete got in since the check, the parent was never released */
+	if (PARENT_MODE != LOCK_MODE_READ && (result = lockListUpgrade(parent_inumber)) != SUCCESS)
+		return result;
+
 	/* create node and add entry to folder that contains new node */
 	child_inumber = inode_create(nodeType);
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
-		        child_name, parent_name);
-		lockListClear(lockList);
+		printf("failed to create %.*s in  %.*s, couldn't allocate inode\n",
+		        PATH_LEN(path, child), PATH_NAME(path, child), parent_len, path->str);
 		return FAIL;
 	}
 
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
-		       child_name, parent_name);
-		lockListClear(lockList);
+	result = dir_add_entry(parent_inumber, child_inumber, PATH_NAME(path, child), PATH_LEN(path, child), PATH_HASH(path, child));
+	if (result != SUCCESS) {
+		inode_delete(child_inumber);
+		/* filled up by concurrent creates since it was checked */
+		if (result == DIR_FULL)
+			return RETRY;
+		printf("could not add entry %.*s in dir %.*s\n",
+		       PATH_LEN(path, child), PATH_NAME(path, child), parent_len, path->str);
 		return FAIL;
 	}
 
-	lockListClear(lockList);
 	return SUCCESS;
 }
 
 
 /*
- * Deletes a node given a path.
+ * Creates a new node given a path.
  * Input:
  *  - name: path of node
+ *  - nodeType: type of node
  * Returns: SUCCESS or FAIL
  */
-int delete(char *name){
+int create(char *name, type nodeType){
 
-	pthread_rwlock_t *lockList[INODE_TABLE_SIZE] = {NULL};
+	int result, attempts = 0;
+	Path path;
 
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	if (path_parse(&path, name) == FAIL || path.depth == 0) {
+		printf("failed to create %s, invalid path\n", name);
+		return FAIL;
+	}
+
+	sync_enter(SYNC_WRITE);
+	inode_update_begin();
+	while ((result = create_locked(&path, nodeType)) == RETRY) {
+		lockListClear();
+		lockBackoff(attempts++);
+	}
+	lockListClear();
+	inode_update_end();
+	sync_exit();
+	return result;
+}
+
+
+/*
+ * Deletes a node given a path, leaving the locks it takes held.
+ * Input:
+ *  - path: parsed path of node, at least one component deep
+ * Returns: SUCCESS, FAIL or RETRY
+ */
+static int delete_locked(const Path *path){
+
+	int parent_inumber, child_inumber, result;
+	int child = path->depth - 1, parent_len = path_parent_len(path);
 	/* use for copy */
 	type pType, cType;
 	union Data pdata, cdata;
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
-
-	parent_inumber = lookup(parent_name, lockList);
+	/* Parent is left locked, in upgradable mode unless entries are removed lock-free, and its ancestors unlocked */
+	parent_inumber = lookup_coupled(path, child, PARENT_MODE, INTENT_IX);
 
+	if (parent_inumber == RETRY)
+		return RETRY;
 	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n",
-		        child_name, parent_name);
-		lockListClear(lockList);
+		printf("failed to delete %.*s, invalid parent dir %.*s\n",
+		        PATH_LEN(path, child), PATH_NAME(path, child), parent_len, path->str);
 		return FAIL;
 	}
 
-	/* Parent is already locked in read mode due to the lookup */
-	lockListSwitchToWr(parent_inumber, lockList);
-	inode_get(parent_inumber, &pType, &pdata);
-
-	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
-		        child_name, parent_name);
-		lockListClear(lockList);
+	if(inode_get(parent_inumber, &pType, &pdata) == FAIL || pType != T_DIRECTORY) {
+		printf("failed to delete %.*s, parent %.*s is not a dir\n",
+		        PATH_LEN(path, child), PATH_NAME(path, child), parent_len, path->str);
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(path, child, pdata.dir);
 
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n",
-		       name, parent_name);
-		lockListClear(lockList);
+		printf("could not delete %s, does not exist in dir %.*s\n",
+		       path->str, parent_len, path->str);
 		return FAIL;
 	}
 
-	lockListAddWr(child_inumber, lockList);
-	inode_get(child_inumber, &cType, &cdata);
+	/* The parent first, the order every writer takes them in */
+	if (PARENT_MODE != LOCK_MODE_READ && (result = lockListUpgrade(parent_inumber)) != SUCCESS)
+		return result;
+	if (lockListAddWr(child_inumber) == RETRY)
+		return RETRY;
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	/* Under a read locked parent, the entry may be gone (or its inumber reused) by the time the child is locked */
+	if (PARENT_MODE == LOCK_MODE_READ && lookup_sub_node(path, child, pdata.dir) != child_inumber) {
+		printf("could not delete %s, does not exist in dir %.*s\n",
+		       path->str, parent_len, path->str);
+		return FAIL;
+	}
+	if (inode_get(child_inumber, &cType, &cdata) == FAIL) {
+		printf("could not delete %s, does not exist in dir %.*s\n",
+		       path->str, parent_len, path->str);
+		return FAIL;
+	}
+
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
 		printf("could not delete %s: is a directory and not empty\n",
-		       name);
-		lockListClear(lockList);
+		       path->str);
 		return FAIL;
 	}
 
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
-		       child_name, parent_name);
-		lockListClear(lockList);
+	if (dir_reset_entry(parent_inumber, child_inumber, PATH_NAME(path, child), PATH_LEN(path, child), PATH_HASH(path, child)) == FAIL) {
+		printf("failed to delete %.*s from dir %.*s\n",
+		       PATH_LEN(path, child), PATH_NAME(path, child), parent_len, path->str);
 		return FAIL;
 	}
 
 	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n",
-		       child_inumber, parent_name);
-		lockListClear(lockList);
+		printf("could not delete inode number %d from dir %.*s\n",
+		       child_inumber, parent_len, path->str);
 		return FAIL;
 	}
 
-	lockListClear(lockList);
 	return SUCCESS;
 }
 
 
+/*
+ * Deletes a node given a path.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or FAIL
+ */
+int delete(char *name){
+
+	int result, attempts = 0;
+	Path path;
+
+	if (path_parse(&path, name) == FAIL || path.depth == 0) {
+		printf("failed to delete %s, invalid path\n", name);
+		return FAIL;
+	}
+
+	sync_enter(SYNC_WRITE);
+	inode_update_begin();
+	while ((result = delete_locked(&path)) == RETRY) {
+		lockListClear();
+		lockBackoff(attempts++);
+	}
+	lockListClear();
+	inode_update_end();
+	sync_exit();
+	return result;
+}
+
+
 /*
  * Lookup for a given path.
  * Input:
@@ -260,14 +308,14 @@ int delete(char *name){
  * Returns:
  *  inumber: identifier of the i-node, if found
  *     FAIL: otherwise
+ *    RETRY: the caller must clear its locks and try again
  */
-int lookup(char *name, pthread_rwlock_t **lookupLocks){
+int lookup(char *name){
 
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-	char *saveptr;
+	Path path;
 
-	strcpy(full_path, name);
+	if (path_parse(&path, name) == FAIL)
+		return FAIL;
 
 	/* start at root node */
 	int current_inumber = FS_ROOT;
@@ -277,135 +325,493 @@ int lookup(char *name, pthread_rwlock_t **lookupLocks){
 	union Data data;
 
 	/* get root inode data */
-	lockListAddRd(current_inumber, lookupLocks);
-	inode_get(current_inumber, &nType, &data);
+	if (lockListAddRd(current_inumber) == RETRY || inode_get(current_inumber, &nType, &data) == FAIL)
+		return RETRY;
+
+	/* search for all sub nodes, one deleted before it was locked is looked up again */
+	for (int i = 0; i < path.depth && (current_inumber = lookup_sub_node(&path, i, data.dir)) != FAIL; i++) {
+		if (lockListAddRd(current_inumber) == RETRY || inode_get(current_inumber, &nType, &data) == FAIL)
+			return RETRY;
+	}
+	return current_inumber;
+}
+
+/*
+ * Records the next i-node of a path being resolved, for the dentry cache,
+ * while the entry that leads to it is still seen in its parent. With
+ * DIR_LOCKFREE, entries are removed under the parent's read lock, so the
+ * entry may already be gone, and its removal counted in the number read;
+ * it is looked up again once the number is read.
+ * Input:
+ *  - resolved: the path so far, its depth set to FAIL once it can't be cached
+ *  - parent: the directory, locked or read optimistically
+ *  - path, i: the entry is the i-th component of path
+ *  - inumber: what the entry led to
+ */
+static void lookup_record(dentryPath *resolved, int parent, const Path *path, int i, int inumber) {
+
+	if (resolved->depth == FAIL)
+		return;
+	if (resolved->depth == DCACHE_MAX_DEPTH) {
+		resolved->depth = FAIL;
+		return;
+	}
+	resolved->inumbers[resolved->depth] = inumber;
+	resolved->seqs[resolved->depth] = inode_path_seq(inumber);
+#ifdef DIR_LOCKFREE
+	unsigned int seq;
+	if (inode_read_begin(parent, &seq) == RETRY || dir_lookup_optimistic(parent, seq, PATH_NAME(path, i), PATH_LEN(path, i), PATH_HASH(path, i)) != inumber) {
+		resolved->depth = FAIL;
+		return;
+	}
+#endif
+	resolved->depth++;
+}
 
-	char *path = strtok_r(full_path, delim, &saveptr); 
+
+/*
+ * Lookup for a path from the dentry cache: takes the intents on the path,
+ * locks the node found directly, and only then checks that no node of the
+ * path was moved or deleted since it was cached. No other i-node lock may
+ * be held, as the node is not reached from the root.
+ * Input:
+ *  - path, depth: the node is at the first depth components of path
+ *  - mode, intent: as for lookup_coupled
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: the path is not cached, or no longer leads there
+ *    DCACHE_ABSENT: the path is known not to exist, no lock was taken
+ *    RETRY: the caller must clear its locks and try again
+ */
+static int lookup_cached(const Path *path, int depth, int mode, int intent){
+
+	dentryPath cached;
+	int inumber, held, result;
+
+	if ((result = dcache_lookup(path, depth, &cached)) != SUCCESS)
+		return result;
+
+	lockListIntent(FS_ROOT, intent);
+	for (int i = 0; i < cached.depth; i++)
+		lockListIntent(cached.inumbers[i], intent);
+
+	inumber = cached.inumbers[cached.depth - 1];
+	held = lockListHas(inumber);
+	result = mode == LOCK_MODE_WRITE ? lockListAddWr(inumber)
+	       : mode == LOCK_MODE_UPGRADE ? lockListAddUp(inumber)
+	       : lockListAddRd(inumber);
+	if (result != SUCCESS)
+		return result;
+	if (dcache_valid(&cached))
+		return inumber;
+
+	/* moved or deleted since it was looked up, the intents taken are only held for nothing */
+	if (!held)
+		lockListUnlock(inumber);
+	return FAIL;
+}
+
+
+/*
+ * Lookup for a given path with lock coupling: a node is locked before its
+ * parent is unlocked, so at most two nodes are locked at once and writers on
+ * the ancestors are not held up for the rest of the operation. A path found
+ * in the dentry cache is not walked, and a path walked is cached, or
+ * cached as missing if a component was not found.
+ * Input:
+ *  - path, depth: the node is at the first depth components of path
+ *  - mode: LOCK_MODE_* to lock the last node of the path in, the others are read locked
+ *  - intent: INTENT_* taken on every node of the path once it is locked,
+ *    INTENT_IX if the caller changes the node found, or INTENT_NONE
+ * Only the lock of the node found is left held, with the locks already held
+ * before the lookup and the intents.
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ *    RETRY: the caller must clear its locks and try again
+ */
+int lookup_coupled(const Path *path, int depth, int mode, int intent){
+
+	dentryPath resolved = { .depth = 0 };
+
+	if (sync_path_cache()) {
+		int cached = lookup_cached(path, depth, mode, intent);
+		if (cached == DCACHE_ABSENT)
+			return FAIL;
+		if (cached != FAIL)
+			return cached;
+	}
+
+	/* start at root node */
+	int current_inumber = FS_ROOT, child_inumber;
+	int held = lockListHas(current_inumber);
+
+	/* use for copy */
+	type nType;
+	union Data data;
+
+	int result = depth == 0 && mode == LOCK_MODE_WRITE ? lockListAddWr(current_inumber)
+	           : depth == 0 && mode == LOCK_MODE_UPGRADE ? lockListAddUp(current_inumber)
+	           : lockListAddRd(current_inumber);
+	if (result == RETRY)
+		return RETRY;
+	lockListIntent(current_inumber, intent);
+	if (inode_get(current_inumber, &nType, &data) == FAIL)
+		return RETRY;
 
 	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		lockListAddRd(current_inumber, lookupLocks);
-		inode_get(current_inumber, &nType, &data);
-		path = strtok_r(NULL, delim, &saveptr); 
+	for (int i = 0; i < depth; i++) {
+		unsigned long entrySeq = inode_entry_seq(current_inumber);
+
+		if ((child_inumber = lookup_sub_node(path, i, data.dir)) == FAIL) {
+			if (sync_path_cache())
+				dcache_insert_absent(path, depth, &resolved, entrySeq);
+			return FAIL;
+		}
+		lookup_record(&resolved, current_inumber, path, i, child_inumber);
+		result = lockListCouple(current_inumber, child_inumber, i == depth - 1 ? mode : LOCK_MODE_READ, &held);
+		if (result != SUCCESS)
+			return result;
+		lockListIntent(child_inumber, intent);
+		current_inumber = child_inumber;
+		/* deleted, with DIR_LOCKFREE, after its entry was read and before it was locked */
+		if (inode_get(current_inumber, &nType, &data) == FAIL)
+			return RETRY;
 	}
+	if (sync_path_cache())
+		dcache_insert(path, depth, &resolved);
 	return current_inumber;
 }
 
 /*
- * Move file or directory to a new path.
+ * Lookup for a given path without taking locks or writing shared memory:
+ * every directory is read optimistically, and a child is only trusted once
+ * its parent is seen unchanged after the child's version was read. A path
+ * found in the dentry cache is not walked, and a path walked is cached,
+ * or cached as missing if a component was not found.
+ * Returns: inumber, FAIL, or RETRY if a writer changed the path meanwhile
+ */
+static int lookup_optimistic(const Path *path){
+
+	unsigned int seq, child_seq;
+	dentryPath resolved = { .depth = 0 };
+
+	switch (dcache_lookup(path, path->depth, &resolved)) {
+	case SUCCESS:
+		return resolved.inumbers[resolved.depth - 1];
+	case DCACHE_ABSENT:
+		return FAIL;
+	}
+	resolved.depth = 0;
+
+	/* start at root node */
+	int current_inumber = FS_ROOT, child_inumber;
+	if (inode_read_begin(current_inumber, &seq) == RETRY)
+		return RETRY;
+
+	for (int i = 0; i < path->depth; i++) {
+		unsigned long entrySeq = inode_entry_seq(current_inumber);
+
+		child_inumber = dir_lookup_optimistic(current_inumber, seq, PATH_NAME(path, i), PATH_LEN(path, i), PATH_HASH(path, i));
+		if (child_inumber == FAIL)
+			dcache_insert_absent(path, path->depth, &resolved, entrySeq);
+		if (child_inumber == FAIL || child_inumber == RETRY)
+			return child_inumber;
+		lookup_record(&resolved, current_inumber, path, i, child_inumber);
+		if (inode_read_begin(child_inumber, &child_seq) == RETRY
+		        || !inode_read_validate(current_inumber, seq))
+			return RETRY;
+		current_inumber = child_inumber;
+		seq = child_seq;
+	}
+	dcache_insert(path, path->depth, &resolved);
+	return current_inumber;
+}
+
+
+/*
+ * Lookup for a given path that leaves no lock held. Under SYNC_OPTIMISTIC,
+ * tries a few optimistic lookups before falling back to lock coupling.
  * Input:
- *  - origPath: starting path (already verified that exists)
- *  - destPath: destination path (must be in an existent directory, but must not exist)
- * Returns: SUCCESS or FAIL
+ *  - name: path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
  */
-int move(char *origPath, char *destPath)
-{
-	pthread_rwlock_t *destLocks[INODE_TABLE_SIZE] = {NULL};
-	pthread_rwlock_t *origLocks[INODE_TABLE_SIZE] = {NULL};
+int lookup_unlocked(char *name){
+
+	int result, attempts = 0;
+	Path path;
+
+	if (path_parse(&path, name) == FAIL)
+		return FAIL;
+
+	for (int i = 0; sync_optimistic() && i < OPTIMISTIC_ATTEMPTS; i++) {
+		epoch_enter();
+		result = lookup_optimistic(&path);
+		epoch_exit();
+		if (result != RETRY)
+			return result;
+	}
+
+	sync_enter(SYNC_READ);
+	while ((result = lookup_coupled(&path, path.depth, LOCK_MODE_READ, INTENT_NONE)) == RETRY) {
+		lockListClear();
+		lockBackoff(attempts++);
+	}
+	lockListClear();
+	sync_exit();
+	return result;
+}
+
+/*
+ * Lock coupling down path components from a directory whose lock is
+ * already held: every i-node is locked before the previous one is
+ * unlocked.
+ * Input:
+ *  - start: inumber of the directory the components are relative to
+ *  - path, from, to: the components [from, to) of path are below start
+ *  - mode: LOCK_MODE_* to lock the last node in, the others are read locked
+ *  - keep: leave the lock of start held
+ *  - intent: INTENT_* taken on every node below start once it is locked
+ * Returns: inumber, FAIL or RETRY
+ */
+static int lookup_below(int start, const Path *path, int from, int to, int mode, int keep, int intent) {
 
-	/* Destination parameters */
-	int destParentInumber, destination_inumber;
-	char *destParentName, *destChildName;
-	type destParentType;
-	union Data destParentData;
+	int current_inumber = start, child_inumber, result, held = keep;
+	type nType;
+	union Data data;
 
-	/* Origin parameters */
-	int origParentInumber, origin_inumber;
-	char *origParentName, *origChildName;
-	type origParentType;
-	union Data origParentData;
+	for (int i = from; i < to; i++) {
+		/* deleted, with DIR_LOCKFREE, after its entry was read and before it was locked */
+		if (inode_get(current_inumber, &nType, &data) == FAIL)
+			return RETRY;
+		if (nType != T_DIRECTORY || (child_inumber = lookup_sub_node(path, i, data.dir)) == FAIL)
+			return FAIL;
+		result = lockListCouple(current_inumber, child_inumber, i == to - 1 ? mode : LOCK_MODE_READ, &held);
+		if (result != SUCCESS)
+			return result;
+		lockListIntent(child_inumber, intent);
+		current_inumber = child_inumber;
+	}
+	return current_inumber;
+}
 
-	/* Split parent_child_from _path will alter paths*/
-	char destPathCopy[MAX_PATH_SIZE], origPathCopy[MAX_PATH_SIZE];
-	strcpy(destPathCopy, destPath);
-	strcpy(origPathCopy, origPath);
 
-	split_parent_child_from_path(destPathCopy, &destParentName, &destChildName);
-	split_parent_child_from_path(origPathCopy, &origParentName, &origChildName);
+/*
+ * Move file or directory to a new path, leaving the locks it takes held.
+ * Both paths are resolved in one traversal: their common prefix is read once,
+ * down to the deepest directory the two parents share, and each parent is
+ * then reached from there and locked in upgradable mode, or in write mode
+ * if it is the other's ancestor. Both are upgraded to write mode once the
+ * move is checked. A rename within one directory locks that directory alone.
+ * Input:
+ *  - orig: parsed starting path
+ *  - dest: parsed destination path (must be in an existent directory, but must not exist)
+ * Returns: SUCCESS, FAIL or RETRY
+ */
+static int move_locked(const Path *orig, const Path *dest)
+{
+	const char *origPath = orig->str, *destPath = dest->str;
+	int origDepth = orig->depth, destDepth = dest->depth, common = 0, result;
+	int commonInumber, origParentInumber, destParentInumber, origin_inumber;
+	type origParentType, destParentType;
+	union Data origParentData, destParentData;
 
-	destParentInumber = lookup(destParentName, destLocks);
+	if (origDepth == 0 || destDepth == 0)
+	{
+		printf("failed to move %s to %s, can't move the root directory\n", origPath, destPath);
+		return FAIL;
+	}
 
-	/* Destination parent directory must exist */
-	if (destParentInumber == FAIL) 
+	/* Can't move directory into itself, nor under any directory below it */
+	while (common < origDepth && common < destDepth && path_component_equal(orig, common, dest, common))
+		common++;
+	if (common == origDepth && destDepth > origDepth)
 	{
-		printf("failed to move %s to %s, invalid destination parent dir %s\n", origPath, destPath, destParentName);
-		lockListClear(destLocks);
+		printf("failed to move %s to %s, can't move directory into itself\n", origPath, destPath);
 		return FAIL;
 	}
 
-	inode_get(destParentInumber, &destParentType, &destParentData);
-	destination_inumber = lookup_sub_node(destChildName, destParentData.dirEntries);
+	/* The parents are the paths but their last component; the deepest directory both contain is theirs in common */
+	if (common > origDepth - 1)
+		common = origDepth - 1;
+	if (common > destDepth - 1)
+		common = destDepth - 1;
+	/*
+	 * A parent that is the other's ancestor is write locked before the other
+	 * is locked: upgrading it later would wait for its readers, and those
+	 * may be waiting for the other parent on their way down.
+	 */
+	int commonMode = common == origDepth - 1 && common == destDepth - 1 ? LOCK_MODE_UPGRADE
+	               : common == origDepth - 1 || common == destDepth - 1 ? LOCK_MODE_WRITE
+	               : LOCK_MODE_READ;
+
+	result = common > 0 || commonMode == LOCK_MODE_READ ? lockListAddRd(FS_ROOT)
+	       : commonMode == LOCK_MODE_WRITE ? lockListAddWr(FS_ROOT)
+	       : lockListAddUp(FS_ROOT);
+	if (result == RETRY)
+		return RETRY;
+	/* Every directory on both paths gets an IX intent, as for create and delete */
+	lockListIntent(FS_ROOT, INTENT_IX);
+	commonInumber = lookup_below(FS_ROOT, orig, 0, common, commonMode, 0, INTENT_IX);
+	if (commonInumber == RETRY)
+		return RETRY;
+
+	destParentInumber = commonInumber == FAIL ? FAIL
+	        : lookup_below(commonInumber, dest, common, destDepth - 1, LOCK_MODE_UPGRADE, 1, INTENT_IX);
+	if (destParentInumber == RETRY)
+		return RETRY;
+	origParentInumber = destParentInumber == FAIL ? FAIL
+	        : lookup_below(commonInumber, orig, common, origDepth - 1, LOCK_MODE_UPGRADE, 1, INTENT_IX);
+	if (origParentInumber == RETRY)
+		return RETRY;
+
+	if (origParentInumber == FAIL
+	        || inode_get(destParentInumber, &destParentType, &destParentData) == FAIL || destParentType != T_DIRECTORY
+	        || inode_get(origParentInumber, &origParentType, &origParentData) == FAIL || origParentType != T_DIRECTORY)
+	{
+		printf("failed to move %s to %s, invalid parent dir\n", origPath, destPath);
+		return FAIL;
+	}
 
+	/* Both parents are upgradable, so no other create, delete or move changes them from here on */
+	origin_inumber = lookup_sub_node(orig, origDepth - 1, origParentData.dir);
+	if (origin_inumber == FAIL)
+	{
+		printf("failed to move %s to %s, origin path does not exist\n", origPath, destPath);
+		return FAIL;
+	}
 	/* Destination can't already exist */
-	if(destination_inumber != FAIL)
+	if (lookup_sub_node(dest, destDepth - 1, destParentData.dir) != FAIL)
 	{
-		printf("failed to move %s to %s, destination path %s already exists\n", origPath, destPath, destChildName);
-		lockListClear(destLocks);
+		printf("failed to move %s to %s, destination path %.*s already exists\n", origPath, destPath,
+		       PATH_LEN(dest, destDepth - 1), PATH_NAME(dest, destDepth - 1));
 		return FAIL;
 	}
 
-	origParentInumber = lookup(origParentName, origLocks);
-	inode_get(origParentInumber, &origParentType, &origParentData);
-	origin_inumber = lookup_sub_node(origChildName, origParentData.dirEntries);
+	if ((result = lockListUpgrade(origParentInumber)) != SUCCESS
+	        || (result = lockListUpgrade(destParentInumber)) != SUCCESS)
+		return result;
 
-	/* Can't move directory into itself */
-	if(origin_inumber == destParentInumber)
+	if (add_entry_locked(destParentInumber, origin_inumber, dest, destDepth - 1) == FAIL)
 	{
-		printf("failed to move %s to %s, can't move directory into itself\n", origPath, destPath);
-		lockListClear(destLocks);
-		lockListClear(origLocks);
+		printf("failed to move %s to %s, could not add entry\n", origPath, destPath);
 		return FAIL;
 	}
+	dir_reset_entry(origParentInumber, origin_inumber,
+	                PATH_NAME(orig, origDepth - 1), PATH_LEN(orig, origDepth - 1), PATH_HASH(orig, origDepth - 1));
 
-	/* The order of the operations is based on the inumbers of the parents to be locked in write mode */
-	if(destParentInumber > origParentInumber)
-	{
-		/* Move with new name */
-		if(origLocks[destParentInumber] != NULL && destLocks[destParentInumber] != NULL)
-		{
-			/* Removes excess read on opposite lock list*/
-			lockListUnlock(destParentInumber, origLocks); 
-			lockListSwitchToWr(destParentInumber, destLocks);
-		}
-		else
-			lockListSwitchToWr(destParentInumber, destLocks);
-		dir_add_entry(destParentInumber, origin_inumber, destChildName);
-		lockListClear(destLocks);
+	return SUCCESS;
+}
 
-		/* Delete original */
-		lockListSwitchToWr(origParentInumber, origLocks);
-		dir_reset_entry(origParentInumber, origin_inumber);
-		lockListClear(origLocks);
+/*
+ * Move file or directory to a new path.
+ * Input:
+ *  - origPath: starting path
+ *  - destPath: destination path (must be in an existent directory, but must not exist)
+ * Returns: SUCCESS or FAIL
+ */
+int move(char *origPath, char *destPath)
+{
+	Path orig, dest;
+	int result, attempts = 0, renameOnly;
 
-	}
-	else
+	if (path_parse(&orig, origPath) == FAIL || path_parse(&dest, destPath) == FAIL)
 	{
-		/* Delete original */
-		if(origLocks[origParentInumber] != NULL && destLocks[origParentInumber] != NULL)
-		{
-			/* Removes excess read on opposite lock list*/
-			lockListUnlock(origParentInumber, destLocks); 
-			lockListSwitchToWr(origParentInumber, origLocks);
-		}
-		else
-			lockListSwitchToWr(origParentInumber, origLocks);
-		dir_reset_entry(origParentInumber, origin_inumber);
-		lockListClear(origLocks);
+		printf("failed to move %s to %s, invalid path\n", origPath, destPath);
+		return FAIL;
+	}
 
-		/* Move with new name */
-		lockListSwitchToWr(destParentInumber, destLocks);
-		dir_add_entry(destParentInumber, origin_inumber, destChildName);
-		lockListClear(destLocks);
+	/* Moves between directories change ancestry, so they go one at a time */
+	renameOnly = orig.depth == dest.depth;
+	for (int i = 0; renameOnly && i < orig.depth - 1; i++)
+		renameOnly = path_component_equal(&orig, i, &dest, i);
+
+	sync_enter(SYNC_WRITE);
+	inode_update_begin();
+	if (!renameOnly)
+		pthread_mutex_lock(&rename_mutex);
+	while ((result = move_locked(&orig, &dest)) == RETRY) {
+		lockListClear();
+		lockBackoff(attempts++);
 	}
-	
-	return SUCCESS;
+	lockListClear();
+	if (!renameOnly)
+		pthread_mutex_unlock(&rename_mutex);
+	inode_update_end();
+	sync_exit();
+	return result;
 }
 
 /*
- * Prints tecnicofs tree.
+ * Prints tecnicofs tree, as it is at one point in time. The tree is read
+ * from a snapshot, so no create, delete or move waits for the print.
  * Input:
  *  - fp: pointer to output file
  */
 void print_tecnicofs_tree(FILE *fp){
-	inode_print_tree(fp, FS_ROOT, "");
+	sync_enter(SYNC_READ);
+	unsigned long snapshot = inode_snapshot_take();
+
+	epoch_enter();
+	inode_print_tree(fp, FS_ROOT, "", snapshot);
+	epoch_exit();
+	inode_snapshot_release(snapshot);
+	sync_exit();
+}
+
+/*
+ * Prints the subtree under a directory as it is at one point in time. The
+ * subtree is locked as a whole with an S intent, while IS intents go on its
+ * ancestors, so creates, deletes and moves that change anything under it
+ * wait for the print, which still reads it without locks, and those
+ * elsewhere in the tree go on. Printing "/" stops every writer.
+ * Input:
+ *  - fp: pointer to output file
+ *  - path: path of the subtree's root
+ * Returns: SUCCESS or FAIL if the path does not exist
+ */
+int print_tecnicofs_subtree(FILE *fp, char *path){
+
+	char name[MAX_PATH_SIZE + 1];
+	int inumber, frozen = FAIL, attempts = 0, len = 0;
+	Path parsed;
+
+	if (path_parse(&parsed, path) == FAIL)
+		return FAIL;
+	/* printed as the whole tree prints it: no trailing slash, "" for the root */
+	for (int i = 0; i < parsed.depth; i++) {
+		name[len++] = '/';
+		memcpy(name + len, PATH_NAME(&parsed, i), PATH_LEN(&parsed, i));
+		len += PATH_LEN(&parsed, i);
+	}
+	name[len] = '\0';
+
+	sync_enter(SYNC_READ);
+	epoch_enter();
+	for (;;) {
+		inumber = lookup_coupled(&parsed, parsed.depth, LOCK_MODE_READ, INTENT_IS);
+		if (inumber == FAIL)
+			break;
+		/* a writer holding IX on the subtree may be waiting for the read lock */
+		if (inumber != RETRY && (inumber == frozen || lockListTryIntent(inumber, INTENT_S) == SUCCESS)) {
+			lockListUnlock(inumber);
+			inode_print_tree(fp, inumber, name, SNAPSHOT_LIVE);
+			break;
+		}
+		lockListClear();
+		frozen = FAIL;
+		if (inumber == RETRY) {
+			lockBackoff(attempts++);
+			continue;
+		}
+		/* wait for the subtree with nothing held, then check it is still at path */
+		lockListIntent(inumber, INTENT_S);
+		frozen = inumber;
+	}
+	lockListClear();
+	epoch_exit();
+	sync_exit();
+	return inumber == FAIL ? FAIL : SUCCESS;
 }
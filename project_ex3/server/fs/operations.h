@@ -1,15 +1,19 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "path.h"
 #include "../lock.h"
 
 void init_fs();
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(Directory *dir);
 int create(char *name, type nodeType);
 int delete(char *name);
 int move(char *origPath, char *destPath);
-int lookup(char *name, pthread_rwlock_t **lookupLocks);
+int lookup(char *name);
+int lookup_coupled(const Path *path, int depth, int mode, int intent);
+int lookup_unlocked(char *name);
 void print_tecnicofs_tree(FILE *fp);
+int print_tecnicofs_subtree(FILE *fp, char *path);
 
 #endif /* FS_H */
@@ -0,0 +1,78 @@
+#include <string.h>
+#include "path.h"
+#include "dir.h"
+#include "state.h"
+
+
+/*
+ * Splits a path into its components, hashing each one and every prefix of
+ * the path as it goes. The string is not copied nor changed, and must stay
+ * as it is while the path is used.
+ * Input:
+ *  - path: filled with the components
+ *  - str: the path
+ * Returns: SUCCESS, or FAIL if a component or the path is too long
+ */
+int path_parse(Path *path, const char *str) {
+    unsigned int prefixHash = NAME_HASH_INIT;
+    const char *c = str;
+
+    path->str = str;
+    path->depth = 0;
+    for (;;) {
+        while (*c == '/')
+            c++;
+        if (*c == '\0')
+            return SUCCESS;
+        if (path->depth == MAX_PATH_DEPTH || c - str > MAX_PATH_SIZE)
+            return FAIL;
+
+        PathComponent *component = &path->components[path->depth];
+        unsigned int hash = NAME_HASH_INIT;
+        if (path->depth > 0)
+            prefixHash = NAME_HASH_STEP(prefixHash, '/');
+        component->offset = c - str;
+        for (; *c != '/' && *c != '\0'; c++) {
+            hash = NAME_HASH_STEP(hash, *c);
+            prefixHash = NAME_HASH_STEP(prefixHash, *c);
+        }
+        component->len = c - str - component->offset;
+        if (component->len >= MAX_FILE_NAME)
+            return FAIL;
+        component->hash = hash;
+        component->prefixHash = prefixHash;
+        path->depth++;
+    }
+}
+
+
+/*
+ * Returns the length of the parent's path at the start of the string, as
+ * it was written but without trailing slashes: 0 for the root.
+ */
+int path_parent_len(const Path *path) {
+    if (path->depth < 2)
+        return 0;
+    const PathComponent *parent = &path->components[path->depth - 2];
+    return parent->offset + parent->len;
+}
+
+
+/* Tells whether the i-th component of a is the j-th of b */
+int path_component_equal(const Path *a, int i, const Path *b, int j) {
+    return PATH_HASH(a, i) == PATH_HASH(b, j) && PATH_LEN(a, i) == PATH_LEN(b, j)
+        && memcmp(PATH_NAME(a, i), PATH_NAME(b, j), PATH_LEN(a, i)) == 0;
+}
+
+
+/*
+ * Returns the length of the first depth components joined by single
+ * slashes, the string their prefixHash is of.
+ */
+int path_key_len(const Path *path, int depth) {
+    int len = depth > 0 ? depth - 1 : 0;
+
+    for (int i = 0; i < depth; i++)
+        len += PATH_LEN(path, i);
+    return len;
+}
@@ -0,0 +1,39 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include "../../tecnicofs-api-constants.h"
+
+/* Components of a path of at most MAX_PATH_SIZE characters */
+#define MAX_PATH_DEPTH (MAX_PATH_SIZE / 2 + 1)
+
+/*
+ * Component of a path, as a view into the path string: it is neither copied
+ * nor NUL terminated.
+ */
+typedef struct pathComponent {
+    unsigned short offset;   /* of its first character in the path */
+    unsigned short len;
+    unsigned int hash;       /* name_hash of the component */
+    unsigned int prefixHash; /* name_hash of the components up to it, joined by single slashes */
+} PathComponent;
+
+/*
+ * A path split into its components, in one scan. Repeated and trailing
+ * slashes are skipped, so "/a//b/" and "a/b" have the same components.
+ */
+typedef struct path {
+    const char *str;
+    int depth;
+    PathComponent components[MAX_PATH_DEPTH];
+} Path;
+
+#define PATH_NAME(path, i) ((path)->str + (path)->components[i].offset)
+#define PATH_LEN(path, i) ((path)->components[i].len)
+#define PATH_HASH(path, i) ((path)->components[i].hash)
+
+int path_parse(Path *path, const char *str);
+int path_parent_len(const Path *path);
+int path_component_equal(const Path *a, int i, const Path *b, int j);
+int path_key_len(const Path *path, int depth);
+
+#endif /* PATH_H */
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab.h"
+#include "state.h"
+
+/*
+ * Size class allocator for directory (and file) blocks.
+ * Objects are carved from SLAB_SPAN_SIZE aligned spans, so the span of any
+ * object is found by masking its address. Each worker keeps a small stack
+ * of free objects per class and only takes the class mutex to move
+ * SLAB_CACHE_SIZE / 2 objects at a time.
+ */
+
+static const size_t class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+    1024, 1536, 2048, 2560, 3072, 4096, 6144, 8192, 12288, 16384
+};
+#define NUM_CLASSES ((int) (sizeof(class_sizes) / sizeof(class_sizes[0])))
+#define SLAB_MAX_OBJECT 16384
+
+/* Free objects are chained through their first word */
+typedef struct slabObject {
+    struct slabObject *next;
+} slabObject;
+
+/* Lives at the start of every span */
+typedef struct slabSpan {
+    struct slabSpan *next; /* in the class list of spans with free objects */
+    struct slabSpan *prevAll, *nextAll; /* every span of the class */
+    slabObject *freeList;
+    int sizeClass;
+    int capacity;
+    int nFree;
+} __attribute__((aligned(CACHE_LINE_SIZE))) slabSpan;
+
+typedef struct slabClass {
+    pthread_mutex_t mutex;
+    slabSpan *partial; /* spans with at least one free object */
+    slabSpan *all;
+    int nSpans;
+    int nEmpty;        /* spans in partial with every object free */
+    long inUse;        /* objects handed out to workers, cached ones included */
+    long released;     /* spans given back to the OS */
+} __attribute__((aligned(CACHE_LINE_SIZE))) slabClass;
+
+typedef struct slabCache {
+    int count;
+    slabObject *objects[SLAB_CACHE_SIZE];
+} slabCache;
+
+slabClass slab_classes[NUM_CLASSES];
+static __thread slabCache slab_caches[NUM_CLASSES];
+
+
+/*
+ * Returns the smallest size class that fits the given size, or FAIL if the
+ * object is too big and must come from malloc.
+ */
+static int slab_class_of(size_t size) {
+    if (size > SLAB_MAX_OBJECT)
+        return FAIL;
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        if (size <= class_sizes[c])
+            return c;
+    }
+    return FAIL;
+}
+
+
+static slabSpan *slab_span_of(void *ptr) {
+    return (slabSpan *) ((uintptr_t) ptr & ~((uintptr_t) SLAB_SPAN_SIZE - 1));
+}
+
+
+/*
+ * Maps a new span from the OS and carves it into free objects.
+ * Must be called with the class mutex held.
+ */
+static slabSpan *slab_span_create(int c) {
+    /* map twice the size and trim, so the span is SLAB_SPAN_SIZE aligned */
+    char *raw = mmap(NULL, 2 * SLAB_SPAN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map slab span.\n");
+        exit(EXIT_FAILURE);
+    }
+    char *start = (char *) (((uintptr_t) raw + SLAB_SPAN_SIZE - 1) & ~((uintptr_t) SLAB_SPAN_SIZE - 1));
+    if (start > raw)
+        munmap(raw, start - raw);
+    if (start + SLAB_SPAN_SIZE < raw + 2 * SLAB_SPAN_SIZE)
+        munmap(start + SLAB_SPAN_SIZE, raw + 2 * SLAB_SPAN_SIZE - (start + SLAB_SPAN_SIZE));
+
+    slabSpan *span = (slabSpan *) start;
+    span->sizeClass = c;
+    span->capacity = (SLAB_SPAN_SIZE - sizeof(slabSpan)) / class_sizes[c];
+    span->nFree = span->capacity;
+    span->freeList = NULL;
+    for (int i = span->capacity - 1; i >= 0; i--) {
+        slabObject *obj = (slabObject *) (start + sizeof(slabSpan) + i * class_sizes[c]);
+        obj->next = span->freeList;
+        span->freeList = obj;
+    }
+
+    span->next = slab_classes[c].partial;
+    slab_classes[c].partial = span;
+    span->prevAll = NULL;
+    span->nextAll = slab_classes[c].all;
+    if (span->nextAll != NULL)
+        span->nextAll->prevAll = span;
+    slab_classes[c].all = span;
+    slab_classes[c].nSpans++;
+    slab_classes[c].nEmpty++;
+    return span;
+}
+
+
+/*
+ * Gives every fully free span of the class back to the OS, keeping at most
+ * keep of them. Must be called with the class mutex held.
+ */
+static void slab_class_release(int c, int keep) {
+    slabClass *cls = &slab_classes[c];
+    slabSpan **prev = &cls->partial;
+
+    while (*prev != NULL && cls->nEmpty > keep) {
+        slabSpan *span = *prev;
+        if (span->nFree == span->capacity) {
+            *prev = span->next;
+            if (span->prevAll != NULL)
+                span->prevAll->nextAll = span->nextAll;
+            else
+                cls->all = span->nextAll;
+            if (span->nextAll != NULL)
+                span->nextAll->prevAll = span->prevAll;
+            munmap(span, SLAB_SPAN_SIZE);
+            cls->nSpans--;
+            cls->nEmpty--;
+            cls->released++;
+        }
+        else {
+            prev = &span->next;
+        }
+    }
+}
+
+
+/*
+ * Moves half a cache worth of objects from the class spans into the cache.
+ */
+static void slab_cache_refill(int c, slabCache *cache) {
+    slabClass *cls = &slab_classes[c];
+    int n = 0;
+
+    pthread_mutex_lock(&cls->mutex);
+    while (n < SLAB_CACHE_SIZE / 2) {
+        slabSpan *span = cls->partial;
+        if (span == NULL)
+            span = slab_span_create(c);
+        if (span->nFree == span->capacity)
+            cls->nEmpty--;
+
+        cache->objects[cache->count++] = span->freeList;
+        span->freeList = span->freeList->next;
+        span->nFree--;
+        n++;
+
+        /* full spans leave the list until one of their objects is freed */
+        if (span->nFree == 0)
+            cls->partial = span->next;
+    }
+    cls->inUse += n;
+    pthread_mutex_unlock(&cls->mutex);
+}
+
+
+/*
+ * Gives half of a full cache back to the spans they came from, and releases
+ * empty spans beyond SLAB_MAX_EMPTY_SPANS in bulk.
+ */
+static void slab_cache_flush(int c, slabCache *cache) {
+    slabClass *cls = &slab_classes[c];
+    int n = SLAB_CACHE_SIZE / 2;
+
+    pthread_mutex_lock(&cls->mutex);
+    for (int i = 0; i < n; i++) {
+        slabObject *obj = cache->objects[--cache->count];
+        slabSpan *span = slab_span_of(obj);
+
+        if (span->nFree == 0) {
+            span->next = cls->partial;
+            cls->partial = span;
+        }
+        obj->next = span->freeList;
+        span->freeList = obj;
+        span->nFree++;
+        if (span->nFree == span->capacity)
+            cls->nEmpty++;
+    }
+    cls->inUse -= n;
+    if (cls->nEmpty > SLAB_MAX_EMPTY_SPANS)
+        slab_class_release(c, SLAB_MAX_EMPTY_SPANS);
+    pthread_mutex_unlock(&cls->mutex);
+}
+
+
+/*
+ * Initializes the size classes.
+ */
+void slab_init() {
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        pthread_mutex_init(&slab_classes[c].mutex, NULL);
+        slab_classes[c].partial = NULL;
+        slab_classes[c].all = NULL;
+        slab_classes[c].nSpans = 0;
+        slab_classes[c].nEmpty = 0;
+        slab_classes[c].inUse = 0;
+        slab_classes[c].released = 0;
+    }
+}
+
+
+/*
+ * Gives every span back to the OS. Objects still in use become invalid.
+ */
+void slab_destroy() {
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        slabClass *cls = &slab_classes[c];
+        while (cls->all != NULL) {
+            slabSpan *span = cls->all;
+            cls->all = span->nextAll;
+            munmap(span, SLAB_SPAN_SIZE);
+        }
+        cls->partial = NULL;
+        cls->nSpans = cls->nEmpty = 0;
+        cls->inUse = 0;
+        pthread_mutex_destroy(&cls->mutex);
+        slab_caches[c].count = 0;
+    }
+}
+
+
+/*
+ * Allocates an object of the given size.
+ * Returns: pointer to the object (never NULL)
+ */
+void *slab_alloc(size_t size) {
+    int c = slab_class_of(size);
+
+    if (c == FAIL) {
+        void *ptr = malloc(size);
+        if (ptr == NULL) {
+            fprintf(stderr, "Error: failed to allocate %zu bytes.\n", size);
+            exit(EXIT_FAILURE);
+        }
+        return ptr;
+    }
+
+    slabCache *cache = &slab_caches[c];
+    if (cache->count == 0)
+        slab_cache_refill(c, cache);
+    return cache->objects[--cache->count];
+}
+
+
+/*
+ * Frees an object. The size must be the one given to slab_alloc.
+ */
+void slab_free(void *ptr, size_t size) {
+    int c = slab_class_of(size);
+
+    if (ptr == NULL)
+        return;
+    if (c == FAIL) {
+        free(ptr);
+        return;
+    }
+
+    slabCache *cache = &slab_caches[c];
+    if (cache->count == SLAB_CACHE_SIZE)
+        slab_cache_flush(c, cache);
+    cache->objects[cache->count++] = ptr;
+}
+
+
+/*
+ * Gives every fully free span back to the OS.
+ */
+void slab_release() {
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        pthread_mutex_lock(&slab_classes[c].mutex);
+        slab_class_release(c, 0);
+        pthread_mutex_unlock(&slab_classes[c].mutex);
+    }
+}
+
+
+/*
+ * Prints the occupancy of every size class in use.
+ */
+void slab_print_stats(FILE *fp) {
+    fprintf(fp, "slab allocator (objects in use include those cached by workers):\n");
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        slabClass *cls = &slab_classes[c];
+        pthread_mutex_lock(&cls->mutex);
+        if (cls->nSpans > 0 || cls->released > 0) {
+            long capacity = (long) cls->nSpans * ((SLAB_SPAN_SIZE - sizeof(slabSpan)) / class_sizes[c]);
+            fprintf(fp, "  class %5zu: %d spans (%d empty, %ld released), %ld/%ld objects in use (%.1f%%)\n",
+                    class_sizes[c], cls->nSpans, cls->nEmpty, cls->released, cls->inUse, capacity,
+                    capacity ? 100.0 * cls->inUse / capacity : 0.0);
+        }
+        pthread_mutex_unlock(&cls->mutex);
+    }
+}
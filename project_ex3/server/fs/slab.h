@@ -0,0 +1,21 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Spans are SLAB_SPAN_SIZE aligned regions holding objects of a single size class */
+#define SLAB_SPAN_SIZE (128 * 1024)
+/* Objects each worker keeps per size class before going to the shared spans */
+#define SLAB_CACHE_SIZE 32
+/* Fully free spans kept per size class before they are given back to the OS */
+#define SLAB_MAX_EMPTY_SPANS 2
+
+void slab_init();
+void slab_destroy();
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+void slab_release();
+void slab_print_stats(FILE *fp);
+
+#endif /* SLAB_H */
@@ -2,11 +2,84 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sched.h>
 #include "state.h"
+#include "slab.h"
+#include "epoch.h"
+#include "sync.h"
+#include "dhash.h"
+#include "tags.h"
 #include "../../tecnicofs-api-constants.h"
 #include "../lock.h"
 
-inode_t inode_table[INODE_TABLE_SIZE];
+/* The i-node table is a list of fixed size chunks, so i-nodes never move once allocated */
+inodeChunk *inode_chunks[INODE_MAX_CHUNKS];
+int inode_capacity = 0;
+
+/* Free i-nodes are chained through inodeChunk.nextFree */
+int free_head = FREE_INODE;
+pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Per worker cache of reserved inumbers. Workers allocate and free from their
+ * own magazine and only touch the global free list once every MAGAZINE_BATCH
+ * operations. The mutex is only contended when another worker steals.
+ */
+typedef struct magazine {
+    pthread_mutex_t mutex;
+    int count;
+    int inumbers[MAGAZINE_SIZE];
+    struct magazine *next; /* all magazines, so empty workers can steal */
+} __attribute__((aligned(CACHE_LINE_SIZE))) magazine_t;
+
+magazine_t *magazines = NULL; /* protected by table_mutex */
+static __thread magazine_t *thread_magazine = NULL;
+
+/* Allocator statistics */
+long alloc_refills = 0, alloc_flushes = 0, alloc_steals = 0;
+
+/*
+ * Copy-on-write snapshots. A snapshot sees the tree as it was in the
+ * generation it was taken in, and taking one starts a new generation. The
+ * first change to an i-node in a generation saves the state the i-node had
+ * as an inodeVersion, if an active snapshot is as recent as that state, so
+ * only what changes while snapshots are read is copied. Creates, deletes
+ * and moves read lock the gate, so a snapshot, which write locks it, is
+ * taken between operations and never sees half of one.
+ */
+unsigned long snapshot_generation = 1;
+rwLock snapshot_gate;
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Generations of the active snapshots, oldest first, protected by snapshot_mutex */
+unsigned long *snapshots = NULL;
+int snapshot_count = 0, snapshot_capacity = 0;
+/* Newest and oldest active snapshot, 0 if there is none */
+unsigned long snapshot_newest = 0, snapshot_oldest = 0;
+
+/* Snapshot statistics */
+long snapshots_taken = 0, versions_saved = 0, versions_freed = 0;
+
+#define CHUNK(inumber) (inode_chunks[(inumber) / INODE_CHUNK_SIZE])
+#define SLOT(inumber) ((inumber) % INODE_CHUNK_SIZE)
+#define INODE_TYPE(inumber) (CHUNK(inumber)->nodeType[SLOT(inumber)])
+#define INODE_VERSION(inumber) (CHUNK(inumber)->version[SLOT(inumber)])
+#define INODE_DATA(inumber) (CHUNK(inumber)->data[SLOT(inumber)])
+#define INODE_SEQ(inumber) (CHUNK(inumber)->seq[SLOT(inumber)])
+#define INODE_NEXT(inumber) (CHUNK(inumber)->nextFree[SLOT(inumber)])
+#define INODE_GENERATION(inumber) (CHUNK(inumber)->generation[SLOT(inumber)])
+#define INODE_VERSIONS(inumber) (CHUNK(inumber)->versions[SLOT(inumber)])
+#define INODE_PATH_SEQ(inumber) (CHUNK(inumber)->pathSeq[SLOT(inumber)])
+#define INODE_ENTRY_SEQ(inumber) (CHUNK(inumber)->entrySeq[SLOT(inumber)])
+#ifdef LOCK_STRIPING
+/* I-nodes whose inumbers are equal modulo LOCK_STRIPES share a lock */
+inodeLock lock_stripes[LOCK_STRIPES];
+#define INODE_LOCK(inumber) (&lock_stripes[(inumber) & (LOCK_STRIPES - 1)].lock)
+#define INODE_INTENT(inumber) (&lock_stripes[(inumber) & (LOCK_STRIPES - 1)].intent)
+#else
+#define INODE_LOCK(inumber) (&CHUNK(inumber)->locks[SLOT(inumber)].lock)
+#define INODE_INTENT(inumber) (&CHUNK(inumber)->locks[SLOT(inumber)].intent)
+#endif
 
 
 /*
@@ -17,15 +90,185 @@ void insert_delay(int cycles) {
 }
 
 
+/*
+ * Checks if the inumber refers to an allocated i-node.
+ */
+static int inode_invalid(int inumber) {
+    return (inumber < 0) || (inumber >= inode_table_capacity()) || (INODE_TYPE(inumber) == T_NONE);
+}
+
+
+/*
+ * Returns the number of i-nodes the table can currently hold.
+ */
+int inode_table_capacity() {
+    return __atomic_load_n(&inode_capacity, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Returns the version of an i-node, which changes every time the inumber is
+ * created or deleted, so stale references to a reused inumber can be told apart.
+ */
+unsigned int inode_version(int inumber) {
+    if (inumber < 0 || inumber >= inode_table_capacity())
+        return 0;
+    return INODE_VERSION(inumber);
+}
+
+
+/*
+ * Returns the path sequence number of an i-node. It is odd while an entry
+ * for the i-node is being removed from a directory, and changes every time
+ * one is, so a path resolved to the i-node, or through it, is known to
+ * still lead there while the number stays the same.
+ */
+unsigned int inode_path_seq(int inumber) {
+    if (inumber < 0 || inumber >= inode_table_capacity())
+        return 1;
+    return __atomic_load_n(&INODE_PATH_SEQ(inumber), __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Returns the entry sequence number of a directory: how many adds of an
+ * entry started, in the high half, and how many finished, in the low one.
+ * While it is ENTRY_SEQ_SETTLED and stays the same, a name found missing
+ * from the directory is known to still be missing.
+ */
+unsigned long inode_entry_seq(int inumber) {
+    if (inumber < 0 || inumber >= inode_table_capacity())
+        return 1UL << 32;
+    return __atomic_load_n(&INODE_ENTRY_SEQ(inumber), __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Seqlock write side: the sequence number of an i-node is odd while its
+ * type or directory changes, so optimistic readers can tell they raced with
+ * a writer. Writers hold the i-node's write lock, or own a new i-node.
+ */
+static void inode_write_begin(int inumber) {
+    __atomic_store_n(&INODE_SEQ(inumber), INODE_SEQ(inumber) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void inode_write_end(int inumber) {
+    __atomic_store_n(&INODE_SEQ(inumber), INODE_SEQ(inumber) + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Starts an optimistic read of an i-node.
+ * Returns: SUCCESS, or RETRY if it is being written (or the inumber is out of the table)
+ */
+int inode_read_begin(int inumber, unsigned int *seq) {
+    if (inumber < 0 || inumber >= inode_table_capacity())
+        return RETRY;
+    *seq = __atomic_load_n(&INODE_SEQ(inumber), __ATOMIC_ACQUIRE);
+    return (*seq & 1) ? RETRY : SUCCESS;
+}
+
+
+/*
+ * Checks that an i-node did not change since inode_read_begin gave seq.
+ */
+int inode_read_validate(int inumber, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&INODE_SEQ(inumber), __ATOMIC_RELAXED) == seq;
+}
+
+
+/*
+ * Looks an entry up in a directory without its lock. Must be called inside
+ * an epoch read section.
+ * Input:
+ *  - inumber: identifier of the directory i-node
+ *  - seq: from inode_read_begin
+ *  - sub_name, len, hash: name of the entry, its length and name_hash
+ * Returns: the entry's inumber, FAIL (not found or not a directory) or RETRY
+ */
+int dir_lookup_optimistic(int inumber, unsigned int seq, const char *sub_name, int len, unsigned int hash) {
+    type nType = INODE_TYPE(inumber);
+    Directory *dir = INODE_DATA(inumber).dir;
+
+    if (!inode_read_validate(inumber, seq))
+        return RETRY;
+    if (nType != T_DIRECTORY || dir == NULL)
+        return FAIL;
+    return directory_lookup_optimistic(dir, sub_name, len, hash, &INODE_SEQ(inumber), seq);
+}
+
+
+/*
+ * Adds a new chunk of free i-nodes to the table.
+ * Must be called with table_mutex held.
+ * Returns: SUCCESS or FAIL (table is full)
+ */
+static int inode_table_grow() {
+    int chunk = inode_capacity / INODE_CHUNK_SIZE;
+    int first = chunk * INODE_CHUNK_SIZE;
+
+    if (chunk == INODE_MAX_CHUNKS) {
+        return FAIL;
+    }
+
+    inodeChunk *nodes;
+    if (posix_memalign((void **) &nodes, CACHE_LINE_SIZE, sizeof(inodeChunk)) != 0) {
+        fprintf(stderr, "Error: failed to allocate i-node chunk.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < INODE_CHUNK_SIZE; i++) {
+        nodes->nodeType[i] = T_NONE;
+        nodes->version[i] = 0;
+        nodes->seq[i] = 0;
+        nodes->data[i].dir = NULL;
+        nodes->generation[i] = 0;
+        nodes->versions[i] = NULL;
+        nodes->pathSeq[i] = 0;
+        nodes->entrySeq[i] = 0;
+#ifndef LOCK_STRIPING
+        /* Node locks live as long as the table, so create/delete never init or destroy them */
+        lockInit(&nodes->locks[i].lock, LOCK_DEFAULT_FLAGS | (first + i == FS_ROOT ? LOCK_PREFER_BIAS : 0));
+        lockIntentInit(&nodes->locks[i].intent);
+#endif
+        /* lowest inumbers are handed out first */
+        nodes->nextFree[i] = (i + 1 < INODE_CHUNK_SIZE) ? first + i + 1 : free_head;
+    }
+
+    inode_chunks[chunk] = nodes;
+    free_head = first;
+    /* publish the chunk only after it is fully initialized */
+    __atomic_store_n(&inode_capacity, first + INODE_CHUNK_SIZE, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+
 /*
  * Initializes the i-nodes table.
  */
 void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
+    slab_init();
+    epoch_init();
+    tags_init();
+#ifdef DIR_GLOBAL_TABLE
+    dhash_init();
+#endif
+    /* taken by every operation that changes the tree, so reader biased */
+    lockInit(&snapshot_gate, LOCK_PREFER_BIAS | LOCK_PREFER_WRITER);
+    snapshot_generation = 1;
+    snapshot_newest = snapshot_oldest = 0;
+#ifdef LOCK_STRIPING
+    /* every operation starts at the root, so its lock is reader biased from the start */
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        lockInit(&lock_stripes[i].lock, LOCK_DEFAULT_FLAGS | (i == (FS_ROOT & (LOCK_STRIPES - 1)) ? LOCK_PREFER_BIAS : 0));
+        lockIntentInit(&lock_stripes[i].intent);
     }
+#endif
+    inode_capacity = 0;
+    free_head = FREE_INODE;
+    inode_table_grow();
 }
 
 /*
@@ -33,14 +276,341 @@ void inode_table_init() {
  */
 
 void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	  if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
+    int capacity = inode_table_capacity();
+
+    for (int i = 0; i < capacity; i++) {
+        if (INODE_TYPE(i) == T_DIRECTORY) {
+            directory_free(INODE_DATA(i).dir);
+        }
+        while (INODE_VERSIONS(i) != NULL) {
+            inodeVersion *version = INODE_VERSIONS(i);
+            INODE_VERSIONS(i) = version->older;
+            directory_listing_free(&version->entries);
+            free(version);
+        }
+    }
+    lockDestroy(&snapshot_gate);
+    free(snapshots);
+    snapshots = NULL;
+    snapshot_count = snapshot_capacity = 0;
+    /* releases the retired blocks and i-nodes while the magazines still exist */
+    epoch_destroy();
+#ifdef DIR_GLOBAL_TABLE
+    dhash_destroy();
+#endif
+
+#ifdef LOCK_STRIPING
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        lockDestroy(&lock_stripes[i].lock);
+        lockIntentDestroy(&lock_stripes[i].intent);
+    }
+#else
+    for (int i = 0; i < capacity; i++) {
+        lockDestroy(INODE_LOCK(i));
+        lockIntentDestroy(INODE_INTENT(i));
+    }
+#endif
+    for (int chunk = 0; chunk < capacity / INODE_CHUNK_SIZE; chunk++) {
+        free(inode_chunks[chunk]);
+        inode_chunks[chunk] = NULL;
+    }
+    inode_capacity = 0;
+    free_head = FREE_INODE;
+
+    while (magazines != NULL) {
+        magazine_t *mag = magazines;
+        magazines = mag->next;
+        pthread_mutex_destroy(&mag->mutex);
+        free(mag);
+    }
+    thread_magazine = NULL;
+    slab_destroy();
+}
+
+
+/*
+ * Returns the calling worker's magazine, registering a new one on first use.
+ */
+static magazine_t *magazine_get() {
+    if (thread_magazine != NULL)
+        return thread_magazine;
+
+    magazine_t *mag;
+    if (posix_memalign((void **) &mag, CACHE_LINE_SIZE, sizeof(magazine_t)) != 0) {
+        fprintf(stderr, "Error: failed to allocate i-node magazine.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&mag->mutex, NULL);
+    mag->count = 0;
+
+    pthread_mutex_lock(&table_mutex);
+    mag->next = magazines;
+    magazines = mag;
+    pthread_mutex_unlock(&table_mutex);
+
+    thread_magazine = mag;
+    return mag;
+}
+
+
+/*
+ * Moves up to MAGAZINE_BATCH inumbers from the global free list into an empty
+ * magazine, growing the table if needed. Must be called with mag->mutex held.
+ * Returns: number of inumbers moved
+ */
+static int magazine_refill(magazine_t *mag) {
+    int n = 0;
+
+    pthread_mutex_lock(&table_mutex);
+    while (n < MAGAZINE_BATCH) {
+        if (free_head == FREE_INODE && inode_table_grow() == FAIL)
+            break;
+        mag->inumbers[n++] = free_head;
+        free_head = INODE_NEXT(free_head);
+    }
+    pthread_mutex_unlock(&table_mutex);
+
+    /* the magazine is a stack, keep the lowest inumber on top */
+    for (int i = 0; i < n / 2; i++) {
+        int tmp = mag->inumbers[i];
+        mag->inumbers[i] = mag->inumbers[n - 1 - i];
+        mag->inumbers[n - 1 - i] = tmp;
+    }
+    mag->count = n;
+
+    if (n > 0)
+        __atomic_add_fetch(&alloc_refills, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+
+/*
+ * Takes half of another worker's magazine once the table can't grow anymore.
+ * Must be called with mag->mutex held, so victims are only try-locked.
+ * Returns: number of inumbers stolen
+ */
+static int magazine_steal(magazine_t *mag) {
+    int n = 0;
+
+    pthread_mutex_lock(&table_mutex);
+    for (magazine_t *victim = magazines; victim != NULL && n == 0; victim = victim->next) {
+        if (victim == mag || pthread_mutex_trylock(&victim->mutex) != 0)
+            continue;
+        int take = (victim->count + 1) / 2;
+        while (n < take) {
+            mag->inumbers[n++] = victim->inumbers[--victim->count];
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+    pthread_mutex_unlock(&table_mutex);
+    mag->count = n;
+
+    if (n > 0)
+        __atomic_add_fetch(&alloc_steals, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+
+/*
+ * Gives MAGAZINE_BATCH inumbers from a full magazine back to the global free list.
+ * Must be called with mag->mutex held.
+ */
+static void magazine_flush(magazine_t *mag) {
+    pthread_mutex_lock(&table_mutex);
+    for (int i = 0; i < MAGAZINE_BATCH; i++) {
+        int inumber = mag->inumbers[--mag->count];
+        INODE_NEXT(inumber) = free_head;
+        free_head = inumber;
+    }
+    pthread_mutex_unlock(&table_mutex);
+
+    __atomic_add_fetch(&alloc_flushes, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Prints the i-node allocator statistics.
+ */
+void inode_alloc_print_stats(FILE *fp) {
+    fprintf(fp, "inode allocator: capacity %d, refills %ld, flushes %ld, steals %ld\n",
+            inode_table_capacity(),
+            __atomic_load_n(&alloc_refills, __ATOMIC_RELAXED),
+            __atomic_load_n(&alloc_flushes, __ATOMIC_RELAXED),
+            __atomic_load_n(&alloc_steals, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Prints the counters of the i-node locks added up, and the lock that
+ * waited the longest.
+ */
+void inode_lock_print_stats(FILE *fp) {
+    long acquisitions = 0, contended = 0, waitNs = 0, worstNs = -1;
+    int worst = FS_ROOT;
+#ifdef LOCK_STRIPING
+    int locks = LOCK_STRIPES;
+#else
+    int locks = inode_table_capacity();
+#endif
+
+    for (int i = 0; i < locks; i++) {
+        long a, c, w;
+        lockStats(INODE_LOCK(i), &a, &c, &w);
+        acquisitions += a;
+        contended += c;
+        waitNs += w;
+        if (w > worstNs) {
+            worstNs = w;
+            worst = i;
         }
     }
+    fprintf(fp, "inode locks: %ld acquisitions, %ld contended, %.3f ms waited, most by %s %d (%.3f ms)\n",
+            acquisitions, contended, waitNs / 1e6,
+#ifdef LOCK_STRIPING
+            "stripe",
+#else
+            "inode",
+#endif
+            worst, worstNs / 1e6);
+}
+
+/*
+ * Brackets a create, delete or move, so snapshots are taken between
+ * operations.
+ */
+void inode_update_begin() {
+    lockrd(&snapshot_gate);
+}
+
+void inode_update_end() {
+    unlock(&snapshot_gate);
+}
+
+
+/*
+ * Takes a snapshot of the tree. Only waits for the operations in progress
+ * to end, nothing is copied.
+ * Returns: the snapshot, to read with inode_print_tree until it is released
+ */
+unsigned long inode_snapshot_take() {
+    lockwr(&snapshot_gate);
+    pthread_mutex_lock(&snapshot_mutex);
+    if (snapshot_count == snapshot_capacity) {
+        snapshot_capacity = snapshot_capacity == 0 ? 4 : snapshot_capacity * 2;
+        snapshots = realloc(snapshots, sizeof(unsigned long) * snapshot_capacity);
+        if (snapshots == NULL) {
+            fprintf(stderr, "Error: failed to grow snapshot list.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long snapshot = snapshot_generation;
+    snapshots[snapshot_count++] = snapshot;
+    __atomic_store_n(&snapshot_newest, snapshot, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot_oldest, snapshots[0], __ATOMIC_RELAXED);
+    /* operations see the new generation once they get through the gate */
+    __atomic_store_n(&snapshot_generation, snapshot + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&snapshot_mutex);
+    unlock(&snapshot_gate);
+
+    __atomic_add_fetch(&snapshots_taken, 1, __ATOMIC_RELAXED);
+    return snapshot;
+}
+
+
+/*
+ * Releases a snapshot. The states saved for it are freed by the next
+ * changes to their i-nodes.
+ */
+void inode_snapshot_release(unsigned long snapshot) {
+    pthread_mutex_lock(&snapshot_mutex);
+    for (int i = 0; i < snapshot_count; i++) {
+        if (snapshots[i] == snapshot) {
+            snapshot_count--;
+            for (; i < snapshot_count; i++)
+                snapshots[i] = snapshots[i + 1];
+        }
+    }
+    __atomic_store_n(&snapshot_newest, snapshot_count > 0 ? snapshots[snapshot_count - 1] : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot_oldest, snapshot_count > 0 ? snapshots[0] : 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+
+/* Frees a saved state, once no snapshot reader can still be looking at it */
+static void inode_version_free(void *version, size_t unused) {
+    directory_listing_free(&((inodeVersion *) version)->entries);
+    free(version);
+    __atomic_add_fetch(&versions_freed, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Saves the state of an i-node that is about to change, if an active
+ * snapshot may read it, and frees the saved states no active snapshot is
+ * old enough to read. Every change to an i-node starts here, inside
+ * inode_update_begin, so it is done once per i-node and generation; other
+ * writers of a concurrent directory wait while its state is saved.
+ */
+static void inode_snapshot_save(int inumber) {
+    unsigned long current = __atomic_load_n(&snapshot_generation, __ATOMIC_RELAXED);
+    unsigned long generation;
+
+    for (;;) {
+        generation = __atomic_load_n(&INODE_GENERATION(inumber), __ATOMIC_ACQUIRE);
+        if (generation == current)
+            return;
+        if (!(generation & SNAPSHOT_SAVING) && __atomic_compare_exchange_n(&INODE_GENERATION(inumber),
+                &generation, generation | SNAPSHOT_SAVING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        sched_yield();
+    }
+
+    unsigned long newest = __atomic_load_n(&snapshot_newest, __ATOMIC_RELAXED);
+    unsigned long oldest = __atomic_load_n(&snapshot_oldest, __ATOMIC_RELAXED);
+
+    /* states are newest first, so the ones no snapshot needs anymore are a suffix */
+    inodeVersion **link = &INODE_VERSIONS(inumber);
+    while (*link != NULL && newest != 0 && (*link)->to >= oldest)
+        link = &(*link)->older;
+    inodeVersion *stale = *link;
+    __atomic_store_n(link, NULL, __ATOMIC_RELEASE);
+    while (stale != NULL) {
+        inodeVersion *older = stale->older;
+        epoch_retire_with(inode_version_free, stale, 0);
+        stale = older;
+    }
+
+    /* a free i-node needs no saved state, snapshots that find none see T_NONE */
+    if (newest != 0 && generation <= newest && INODE_TYPE(inumber) != T_NONE) {
+        inodeVersion *version = malloc(sizeof(inodeVersion));
+        if (version == NULL) {
+            fprintf(stderr, "Error: failed to save i-node for snapshot.\n");
+            exit(EXIT_FAILURE);
+        }
+        version->from = generation;
+        version->to = current - 1;
+        version->nodeType = INODE_TYPE(inumber);
+        directory_listing_init(&version->entries);
+        if (version->nodeType == T_DIRECTORY)
+            directory_list(INODE_DATA(inumber).dir, &version->entries);
+        version->older = INODE_VERSIONS(inumber);
+        __atomic_store_n(&INODE_VERSIONS(inumber), version, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&versions_saved, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&INODE_GENERATION(inumber), current, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Prints how many snapshots were taken and how many i-node states were
+ * saved for them.
+ */
+void inode_snapshot_print_stats(FILE *fp) {
+    fprintf(fp, "snapshots: %ld taken, generation %lu, %ld states saved, %ld freed\n",
+            __atomic_load_n(&snapshots_taken, __ATOMIC_RELAXED),
+            __atomic_load_n(&snapshot_generation, __ATOMIC_RELAXED),
+            __atomic_load_n(&versions_saved, __ATOMIC_RELAXED),
+            __atomic_load_n(&versions_freed, __ATOMIC_RELAXED));
 }
 
 /*
@@ -55,32 +625,42 @@ int inode_create(type nType) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
-
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-
-                /* Inits node lock */
-                if(pthread_rwlock_init(&inode_table[inumber].lock, NULL) != 0)
-                {
-                    fprintf(stderr, "Error: failed to initialize node lock.\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
-            return inumber;
-        }
+    magazine_t *mag = magazine_get();
+    pthread_mutex_lock(&mag->mutex);
+    if (mag->count == 0 && magazine_refill(mag) == 0 && magazine_steal(mag) == 0) {
+        pthread_mutex_unlock(&mag->mutex);
+        return FAIL;
     }
-    return FAIL;
+    int inumber = mag->inumbers[--mag->count];
+    pthread_mutex_unlock(&mag->mutex);
+
+    INODE_NEXT(inumber) = FREE_INODE;
+    inode_snapshot_save(inumber);
+    inode_write_begin(inumber);
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        INODE_DATA(inumber).dir = directory_new(inumber);
+    }
+    else {
+        INODE_DATA(inumber).fileContents = NULL;
+    }
+    INODE_VERSION(inumber)++;
+    INODE_TYPE(inumber) = nType;
+    inode_write_end(inumber);
+    return inumber;
+}
+
+/*
+ * Gives a deleted i-node back to this worker's magazine, once no lock-free
+ * reader can still be looking at it.
+ */
+static void inode_release(void *unused, size_t inumber) {
+    magazine_t *mag = magazine_get();
+    pthread_mutex_lock(&mag->mutex);
+    if (mag->count == MAGAZINE_SIZE)
+        magazine_flush(mag);
+    mag->inumbers[mag->count++] = inumber;
+    pthread_mutex_unlock(&mag->mutex);
 }
 
 /*
@@ -93,20 +673,21 @@ int inode_delete(int inumber) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (inode_invalid(inumber)) {
         printf("inode_delete: invalid inumber\n");
         return FAIL;
     } 
-    /* Node lock destruction */
-    if(pthread_rwlock_destroy(&inode_table[inumber].lock) != 0)
-    {
-        fprintf(stderr, "Error: failed to destroy node lock.\n");
-        exit(EXIT_FAILURE);
-    }
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    inode_snapshot_save(inumber);
+    inode_write_begin(inumber);
+    if (INODE_TYPE(inumber) == T_DIRECTORY)
+        directory_free(INODE_DATA(inumber).dir);
+    INODE_TYPE(inumber) = T_NONE;
+    INODE_VERSION(inumber)++;
+    INODE_DATA(inumber).dir = NULL;
+    inode_write_end(inumber);
+
+    /* lock-free readers may still be looking at the inumber, so it is not reused yet */
+    epoch_retire_with(inode_release, NULL, inumber);
     return SUCCESS;
 }
 
@@ -123,16 +704,16 @@ int inode_get(int inumber, type *nType, union Data *data) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (inode_invalid(inumber)) {
         printf("inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
     if (nType)
-        *nType = inode_table[inumber].nodeType;
+        *nType = INODE_TYPE(inumber);
 
     if (data)
-        *data = inode_table[inumber].data;
+        *data = INODE_DATA(inumber);
 
     return SUCCESS;
 }
@@ -143,36 +724,45 @@ int inode_get(int inumber, type *nType, union Data *data) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name, len, hash: name of the sub i-node entry, its length and name_hash
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
+int dir_reset_entry(int inumber, int sub_inumber, const char *sub_name, int len, unsigned int hash) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (inode_invalid(inumber)) {
         printf("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (INODE_TYPE(inumber) != T_DIRECTORY) {
         printf("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (inode_invalid(sub_inumber)) {
         printf("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
+
+    inode_snapshot_save(inumber);
+    Directory *dir = INODE_DATA(inumber).dir;
+    int result;
+    /* paths through the entry are stale from here on, whether it is moved or deleted */
+    __atomic_store_n(&INODE_PATH_SEQ(sub_inumber), INODE_PATH_SEQ(sub_inumber) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* concurrent directories are changed one atomic slot at a time, under a read lock */
+    if (dir->kind == DIR_CONCURRENT) {
+        result = directory_remove(dir, sub_name, len, hash, sub_inumber);
+    } else {
+        inode_write_begin(inumber);
+        result = directory_remove(dir, sub_name, len, hash, sub_inumber);
+        inode_write_end(inumber);
     }
-    return FAIL;
+    __atomic_store_n(&INODE_PATH_SEQ(sub_inumber), INODE_PATH_SEQ(sub_inumber) + 1, __ATOMIC_RELEASE);
+    return result;
 }
 
 
@@ -181,142 +771,504 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry 
- * Returns: SUCCESS or FAIL
+ *  - sub_name, len, hash: name of the sub i-node entry, its length and name_hash
+ * Returns: SUCCESS, FAIL or DIR_FULL
  */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+int dir_add_entry(int inumber, int sub_inumber, const char *sub_name, int len, unsigned int hash) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (inode_invalid(inumber)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (INODE_TYPE(inumber) != T_DIRECTORY) {
         printf("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (inode_invalid(sub_inumber)) {
         printf("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    if (strlen(sub_name) == 0 ) {
+    if (len == 0) {
         printf("inode_add_entry: \
                entry name must be non-empty\n");
         return FAIL;
     }
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
+
+    inode_snapshot_save(inumber);
+    Directory *dir = INODE_DATA(inumber).dir;
+    int result;
+    /* names found missing are no longer known to be; concurrent directories take adds under a read lock */
+    __atomic_fetch_add(&INODE_ENTRY_SEQ(inumber), 1UL << 32, __ATOMIC_SEQ_CST);
+    if (dir->kind == DIR_CONCURRENT) {
+        result = directory_insert(dir, sub_name, len, hash, sub_inumber);
+    } else {
+        inode_write_begin(inumber);
+        result = directory_insert(dir, sub_name, len, hash, sub_inumber);
+        inode_write_end(inumber);
+    }
+    __atomic_fetch_add(&INODE_ENTRY_SEQ(inumber), 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+
+/*
+ * Tells whether a directory must be rebuilt before more entries are added
+ * to it without its write lock.
+ * Input:
+ *  - inumber: identifier of the i-node, locked by the caller
+ */
+int dir_needs_rebuild(int inumber) {
+    return INODE_TYPE(inumber) == T_DIRECTORY && directory_needs_rebuild(INODE_DATA(inumber).dir);
+}
+
+
+/*
+ * Rebuilds the table of a concurrent directory, if no one did it already.
+ * Input:
+ *  - inumber: identifier of the i-node, write locked by the caller
+ */
+void dir_rebuild(int inumber) {
+    if (!dir_needs_rebuild(inumber))
+        return;
+    inode_write_begin(inumber);
+    directory_rebuild(INODE_DATA(inumber).dir);
+    inode_write_end(inumber);
+}
+
+
+/*
+ * Copies the type of an i-node and, for a directory, its entries. Tries
+ * optimistic copies first and takes the i-node's read lock only after
+ * OPTIMISTIC_ATTEMPTS conflicts with writers.
+ * Returns: the type of the i-node
+ */
+static type inode_list(int inumber, DirListing *list) {
+    for (int attempt = 0; sync_optimistic() && attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+        unsigned int seq;
+        if (inode_read_begin(inumber, &seq) == RETRY)
+            continue;
+
+        type nType = INODE_TYPE(inumber);
+        Directory *dir = INODE_DATA(inumber).dir;
+        if (!inode_read_validate(inumber, seq))
+            continue;
+        if (nType != T_DIRECTORY || dir == NULL)
+            return nType;
+        if (directory_list_optimistic(dir, list, &INODE_SEQ(inumber), seq) == SUCCESS)
+            return nType;
+    }
+
+    if (sync_inode_locks())
+        lockrd(INODE_LOCK(inumber));
+    type nType = INODE_TYPE(inumber);
+    if (nType == T_DIRECTORY)
+        directory_list(INODE_DATA(inumber).dir, list);
+    if (sync_inode_locks())
+        unlock(INODE_LOCK(inumber));
+    return nType;
+}
+
+
+/*
+ * Copies what inode_list does, for the state an i-node had when a snapshot
+ * was taken: the live one if it did not change since, a saved one otherwise.
+ * Must be called inside an epoch read section.
+ * Returns: the type of the i-node in the snapshot
+ */
+static type inode_snapshot_list(int inumber, unsigned long snapshot, DirListing *list) {
+    for (;;) {
+        unsigned long generation = __atomic_load_n(&INODE_GENERATION(inumber), __ATOMIC_ACQUIRE);
+        list->count = list->size = 0;
+        if (generation & SNAPSHOT_SAVING) {
+            sched_yield();
+            continue;
+        }
+        if (generation <= snapshot) {
+            type nType = inode_list(inumber, list);
+            /* a change saves the state, and so moves the generation, before it is made */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&INODE_GENERATION(inumber), __ATOMIC_RELAXED) == generation)
+                return nType;
+            continue;
         }
+
+        inodeVersion *version = __atomic_load_n(&INODE_VERSIONS(inumber), __ATOMIC_ACQUIRE);
+        while (version != NULL && version->from > snapshot)
+            version = __atomic_load_n(&version->older, __ATOMIC_ACQUIRE);
+        /* free when the snapshot was taken */
+        if (version == NULL || version->to < snapshot)
+            return T_NONE;
+        directory_listing_copy(list, &version->entries);
+        return version->nodeType;
     }
-    return FAIL;
 }
 
 
 /*
- * Prints the i-nodes table.
+ * Prints the i-nodes table without holding locks. With SNAPSHOT_LIVE, each
+ * directory is copied on its own, so the output is consistent per directory,
+ * and i-nodes deleted in the meantime are left out; with a snapshot, the
+ * tree is printed as it was when the snapshot was taken. Must be called
+ * inside an epoch read section, which keeps deleted inumbers from being
+ * reused while the tree is printed.
  * Input:
  *  - inumber: identifier of the i-node
  *  - name: pointer to the name of current file/dir
+ *  - snapshot: from inode_snapshot_take, or SNAPSHOT_LIVE
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return;
-    }
+void inode_print_tree(FILE *fp, int inumber, char *name, unsigned long snapshot) {
+    DirListing list;
+    directory_listing_init(&list);
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+    type nType = snapshot == SNAPSHOT_LIVE ? inode_list(inumber, &list)
+                                           : inode_snapshot_list(inumber, snapshot, &list);
+    if (nType == T_FILE || nType == T_DIRECTORY)
         fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
-            }
+
+    for (int i = 0; i < list.count; i++) {
+        char path[MAX_FILE_NAME];
+        if (snprintf(path, sizeof(path), "%s/%s", name, DIR_LISTING_NAME(&list, i)) > sizeof(path)) {
+            fprintf(stderr, "truncation when building full path\n");
         }
+        inode_print_tree(fp, list.inumbers[i], path, snapshot);
     }
+    directory_listing_free(&list);
 }
 
-/* Adds node lock to the list and locks it on read mode. On invalid inumber, does nothing. */
-void lockListAddRd(int inumber, pthread_rwlock_t **lockList)
+/*
+ * Every thread keeps the locks it holds on a stack of its own, with the mode
+ * each one is held in, in the order it took them. Lock coupling lets go of a
+ * lock below the top, so the stack is kept packed; it never holds more than
+ * a path's worth of locks, so its cost depends on path depth and not on the
+ * table. Operations start with an empty stack and clear it when they end.
+ *
+ * With LOCK_STRIPING, unrelated i-nodes can share a lock and locks are no
+ * longer taken in tree order. An operation then only blocks on a stripe above
+ * every stripe it holds; otherwise it tries the lock and, when it is busy,
+ * gets RETRY, releases everything and starts over.
+ *
+ * Under the synchronization strategies without i-node locks, the stack stays
+ * empty and taking or upgrading a lock always succeeds.
+ *
+ * Intent locks go on the same stack, taken top down along the paths an
+ * operation walks and kept until it ends. They only wait for S and X
+ * holders, which wait for nothing once they have them, so they are not
+ * ordered with the i-node locks.
+ */
+typedef struct heldLock {
+    rwLock *lock;       /* NULL for an intent */
+    intentLock *intent; /* NULL for an i-node lock */
+    int mode;           /* LOCK_MODE_* for an i-node lock, INTENT_* for an intent */
+} heldLock;
+
+typedef struct lockStack {
+    int depth;
+    heldLock held[LOCK_STACK_SIZE];
+} lockStack;
+
+static __thread lockStack lock_stack;
+
+/* Pushes an already taken lock. */
+static void lockListPush(rwLock *lock, int mode)
 {
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("lockListAddRd: invalid inumber %d\n", inumber);
-        return;
+    if (lock_stack.depth == LOCK_STACK_SIZE) {
+        fprintf(stderr, "Error: lock stack overflow.\n");
+        exit(EXIT_FAILURE);
     }
+    lock_stack.held[lock_stack.depth].lock = lock;
+    lock_stack.held[lock_stack.depth].intent = NULL;
+    lock_stack.held[lock_stack.depth].mode = mode;
+    lock_stack.depth++;
+}
 
-    lockrd(&inode_table[inumber].lock);
-    lockList[inumber] = &inode_table[inumber].lock;
+/* Returns the position of the inumber's lock in the stack, or FAIL */
+static int lockListFind(int inumber)
+{
+    if (inumber < 0 || inumber >= inode_table_capacity())
+        return FAIL;
+    for (int i = lock_stack.depth - 1; i >= 0; i--) {
+        if (lock_stack.held[i].lock == INODE_LOCK(inumber))
+            return i;
+    }
+    return FAIL;
 }
 
+/* Removes the entry at position i, keeping the stack packed */
+static void lockListRemove(int i)
+{
+    lock_stack.depth--;
+    for (; i < lock_stack.depth; i++)
+        lock_stack.held[i] = lock_stack.held[i + 1];
+}
 
-/* Adds node lock to the list and locks it on write mode. On invalid inumber, does nothing. */
-void lockListAddWr(int inumber, pthread_rwlock_t **lockList)
+/* Unlocks a held lock, in the mode it is held in */
+static void lockListRelease(heldLock *held)
 {
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("lockListAddWr: invalid inumber %d\n", inumber);
-        return;
-    }
+    if (held->intent != NULL)
+        unlockIntent(held->intent, held->mode);
+    else if (held->mode == LOCK_MODE_UPGRADE)
+        unlockUpgradable(held->lock);
+    else
+        unlock(held->lock);
+}
 
-    lockwr(&inode_table[inumber].lock);
-    lockList[inumber] = &inode_table[inumber].lock;
+#ifdef LOCK_STRIPING
+/* Tells whether a lock after the given one is held, which it must not wait for */
+static int lockListHasAfter(rwLock *lock)
+{
+    for (int i = 0; i < lock_stack.depth; i++) {
+        if (lock_stack.held[i].lock > lock)
+            return 1;
+    }
+    return 0;
 }
+#endif
 
-/* Used for setting parent directories to write mode before using create/delete.*/
-void lockListSwitchToWr(int inumber, pthread_rwlock_t **lockList)
+/*
+ * Takes a lock that is not held yet, in the given LOCK_MODE_*.
+ * Returns: SUCCESS, or RETRY if waiting for it could deadlock
+ */
+static int lockListAcquire(rwLock *lock, int mode)
 {
-    if(lockList[inumber] != NULL)
-    {
-        unlock(lockList[inumber]);
-        if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-            printf("lockListSwitchToWr: invalid inumber %d\n", inumber);
-            return;
+#ifdef LOCK_STRIPING
+    if (lockListHasAfter(lock)) {
+        /* out of order, so never wait */
+        int err = mode == LOCK_MODE_WRITE ? lockTryWr(lock)
+                : mode == LOCK_MODE_UPGRADE ? lockTryUpgradable(lock) : lockTryRd(lock);
+        if (err == EBUSY || err == EAGAIN)
+            return RETRY;
+        if (err != 0) {
+            fprintf(stderr, "Error: failed to lock stripe.\n");
+            exit(EXIT_FAILURE);
         }
-        lockwr(lockList[inumber]);
+        return SUCCESS;
     }
+#endif
+    if (mode == LOCK_MODE_WRITE)
+        lockwr(lock);
+    else if (mode == LOCK_MODE_UPGRADE)
+        lockUpgradable(lock);
+    else
+        lockrd(lock);
+    return SUCCESS;
 }
 
-/* Unlocks the entire list of locks and points them to NULL.*/
-void lockListClear(pthread_rwlock_t **lockList)
+/*
+ * Locks a node in the given LOCK_MODE_* and pushes it. A lock already held
+ * is upgraded to write mode if that is the mode asked for, and otherwise
+ * left as it is. On invalid inumber, does nothing.
+ * Returns: SUCCESS, FAIL (invalid inumber) or RETRY
+ */
+static int lockListAdd(int inumber, int mode)
 {
-    int i;
-    for(i = 0; i < INODE_TABLE_SIZE; i++)
-    {
-        if(lockList[i] != NULL)
-        {
-            unlock(lockList[i]);
-            lockList[i] = NULL;
-        }
+    if (inode_invalid(inumber)) {
+        printf("lockListAdd: invalid inumber %d\n", inumber);
+        return FAIL;
     }
+    if (!sync_inode_locks())
+        return SUCCESS;
+    /* already held through another i-node of the same stripe */
+    if (lockListFind(inumber) != FAIL)
+        return mode == LOCK_MODE_WRITE ? lockListUpgrade(inumber) : SUCCESS;
+
+    if (lockListAcquire(INODE_LOCK(inumber), mode) == RETRY)
+        return RETRY;
+    lockListPush(INODE_LOCK(inumber), mode);
+    return SUCCESS;
+}
+
+/*
+ * Locks a node on read mode and pushes it. On invalid inumber, does nothing.
+ * Returns: SUCCESS, FAIL (invalid inumber) or RETRY
+ */
+int lockListAddRd(int inumber)
+{
+    return lockListAdd(inumber, LOCK_MODE_READ);
 }
 
-/* Unlocks given inumber's lock and points the list's index to null */
-void lockListUnlock(int inumber, pthread_rwlock_t** lockList)
+/*
+ * Locks a node on write mode and pushes it. On invalid inumber, does nothing.
+ * Returns: SUCCESS, FAIL (invalid inumber) or RETRY
+ */
+int lockListAddWr(int inumber)
 {
-    if(lockList[inumber] != NULL)
+    return lockListAdd(inumber, LOCK_MODE_WRITE);
+}
+
+/*
+ * Locks a node on upgradable mode, which lets readers in but no writer nor
+ * other upgrader, and pushes it. On invalid inumber, does nothing.
+ * Returns: SUCCESS, FAIL (invalid inumber) or RETRY
+ */
+int lockListAddUp(int inumber)
+{
+    return lockListAdd(inumber, LOCK_MODE_UPGRADE);
+}
+
+/* Pushes an intent taken in the given INTENT_* mode */
+static void lockListPushIntent(intentLock *intent, int mode)
+{
+    lockListPush(NULL, mode);
+    lock_stack.held[lock_stack.depth - 1].intent = intent;
+}
+
+/* Tells whether an intent is already held in the given mode */
+static int lockListHasIntent(intentLock *intent, int mode)
+{
+    for (int i = lock_stack.depth - 1; i >= 0; i--) {
+        if (lock_stack.held[i].intent == intent && lock_stack.held[i].mode == mode)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Takes an intent on the subtree under a node, in the given INTENT_* mode,
+ * and pushes it. It is held until the stack is cleared. An intent already
+ * held in that mode, through the node or another of its stripe, is not
+ * taken again; INTENT_NONE or an invalid inumber does nothing.
+ */
+void lockListIntent(int inumber, int mode)
+{
+    if (mode == INTENT_NONE || !sync_inode_locks() || inode_invalid(inumber)
+            || lockListHasIntent(INODE_INTENT(inumber), mode))
+        return;
+    lockIntent(INODE_INTENT(inumber), mode);
+    lockListPushIntent(INODE_INTENT(inumber), mode);
+}
+
+/*
+ * Same as lockListIntent, without waiting.
+ * Returns: SUCCESS, FAIL (invalid inumber) or RETRY if a holder conflicts
+ */
+int lockListTryIntent(int inumber, int mode)
+{
+    if (inode_invalid(inumber))
+        return FAIL;
+    if (mode == INTENT_NONE || !sync_inode_locks() || lockListHasIntent(INODE_INTENT(inumber), mode))
+        return SUCCESS;
+    if (lockTryIntent(INODE_INTENT(inumber), mode) != 0)
+        return RETRY;
+    lockListPushIntent(INODE_INTENT(inumber), mode);
+    return SUCCESS;
+}
+
+/*
+ * Turns a held read lock into an upgradable one, without releasing it, so
+ * what was read under it stays valid until it is upgraded.
+ * Returns: SUCCESS, FAIL (not held) or RETRY if another thread has the
+ *  lock in upgradable mode
+ */
+int lockListPromote(int inumber)
+{
+    if (!sync_inode_locks())
+        return SUCCESS;
+
+    int i = lockListFind(inumber);
+    if (i == FAIL)
+        return FAIL;
+    if (lock_stack.held[i].mode != LOCK_MODE_READ)
+        return SUCCESS;
+
+    if (lockTryPromote(lock_stack.held[i].lock) != 0)
+        return RETRY;
+    lock_stack.held[i].mode = LOCK_MODE_UPGRADE;
+    return SUCCESS;
+}
+
+/*
+ * Used for setting parent directories to write mode before using create/delete.
+ * The lock is never released on the way, so nothing read under it changes:
+ * an upgradable lock waits for its readers to leave, a read lock is
+ * promoted to upgradable first.
+ * Returns: SUCCESS, FAIL (not held) or RETRY
+ */
+int lockListUpgrade(int inumber)
+{
+    int result = lockListPromote(inumber);
+    if (result != SUCCESS || !sync_inode_locks())
+        return result;
+
+    heldLock *held = &lock_stack.held[lockListFind(inumber)];
+    if (held->mode == LOCK_MODE_WRITE)
+        return SUCCESS;
+
+#ifdef LOCK_STRIPING
+    /* readers of the stripe may be waiting for a later stripe we hold */
+    if (lockListHasAfter(held->lock)) {
+        if (lockTryUpgrade(held->lock) != 0)
+            return RETRY;
+    } else
+#endif
+    lockUpgrade(held->lock);
+    held->mode = LOCK_MODE_WRITE;
+    return SUCCESS;
+}
+
+/* Unlocks every held lock, the last one taken first.*/
+void lockListClear()
+{
+    while (lock_stack.depth > 0)
     {
-        unlock(lockList[inumber]);
-        lockList[inumber] = NULL;
+        lock_stack.depth--;
+        lockListRelease(&lock_stack.held[lock_stack.depth]);
     }
 }
 
-/*Locks root for printing*/
-void printLock()
+/*
+ * Lock coupling step from parent to child: locks the child in the given
+ * LOCK_MODE_* and only then releases the parent, unless the parent's lock is
+ * also the child's or was already held before the traversal (*held). Under
+ * SYNC_INODE the parent is kept, so the whole path stays locked.
+ * Returns: SUCCESS, FAIL or RETRY. *held is set for the child on SUCCESS.
+ */
+int lockListCouple(int parent, int child, int mode, int *held)
+{
+    int childHeld = lockListFind(child) != FAIL;
+    int result = lockListAdd(child, mode);
+
+    if (result != SUCCESS || INODE_LOCK(parent) == INODE_LOCK(child))
+        return result;
+    if (!*held && sync_coupling())
+        lockListUnlock(parent);
+    *held = childHeld;
+    return SUCCESS;
+}
+
+/* Checks if the given inumber's lock is held */
+int lockListHas(int inumber)
+{
+    return lockListFind(inumber) != FAIL;
+}
+
+/* Unlocks given inumber's lock and removes it from the stack */
+void lockListUnlock(int inumber)
 {
-    lockwr(&inode_table[FS_ROOT].lock);
+    int i = lockListFind(inumber);
+    if(i != FAIL)
+    {
+        lockListRelease(&lock_stack.held[i]);
+        lockListRemove(i);
+    }
 }
 
-/*Unlocks root for print operation*/
-void printUnlock()
+/* Prints the locks held by the calling thread, bottom first */
+void printLockList()
 {
-    unlock(&inode_table[FS_ROOT].lock);
-}
\ No newline at end of file
+    static const char *intentNames[] = { "IS", "IX", "S", "X" };
+
+    for (int i = 0; i < lock_stack.depth; i++) {
+        if (lock_stack.held[i].intent != NULL)
+            printf("#%d| %p | intent %s\n", i, (void *) lock_stack.held[i].intent,
+                   intentNames[lock_stack.held[i].mode]);
+        else
+            printf("#%d| %p | %s\n", i, (void *) lock_stack.held[i].lock,
+                   lock_stack.held[i].mode == LOCK_MODE_WRITE ? "write"
+                   : lock_stack.held[i].mode == LOCK_MODE_UPGRADE ? "upgradable" : "read");
+    }
+}
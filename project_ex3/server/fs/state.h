@@ -5,45 +5,105 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include "../../tecnicofs-api-constants.h"
+#include "../lock.h"
+#include "dir.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+
+/* The i-node table grows one chunk at a time, up to INODE_TABLE_MAX i-nodes */
+#define INODE_CHUNK_SIZE 1024
+#define INODE_MAX_CHUNKS 4096
+#define INODE_TABLE_MAX (INODE_CHUNK_SIZE * INODE_MAX_CHUNKS)
+
+/* Per worker i-node caches: size and number of inumbers moved per refill/flush */
+#define MAGAZINE_SIZE 64
+#define MAGAZINE_BATCH 32
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Build with -DLOCK_STRIPING to take i-node locks from a fixed table of
+ * LOCK_STRIPES locks indexed by inumber, instead of one lock per i-node.
+ * Must be a power of two.
+ */
+#define LOCK_STRIPES 4096
+
+/* Max locks held by one thread: an intent for every component of both paths of a move, plus the i-node locks */
+#define LOCK_STACK_SIZE (MAX_PATH_SIZE + 4)
+
+/* Modes a lock is held in by a lock list */
+#define LOCK_MODE_READ 0
+#define LOCK_MODE_WRITE 1
+#define LOCK_MODE_UPGRADE 2
 
 #define SUCCESS 0
 #define FAIL -1
+/* The operation must release its locks and start over */
+#define RETRY -2
 
 #define DELAY 5000
 
+/* Optimistic reads tried before falling back to locks */
+#define OPTIMISTIC_ATTEMPTS 3
+
+/* Tells whether no entry was being added to a directory when its entry sequence number was read */
+#define ENTRY_SEQ_SETTLED(seq) ((unsigned int) ((seq) >> 32) == (unsigned int) (seq))
+
+/* Snapshot generation that stands for the live tree */
+#define SNAPSHOT_LIVE 0
+/* Set in inodeChunk.generation while the i-node's state is being saved */
+#define SNAPSHOT_SAVING (1UL << 63)
 
-/*
- * Contains the name of the entry and respective i-number
- */
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either text (file) or entries (Directory)
  */
 union Data {
 	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	Directory *dir; /* for directories */
 };
 
 /*
- * I-node definition
+ * I-node table chunk, laid out as a structure of arrays. Types and versions
+ * are packed densely so scans touch few cache lines, data pointers are kept
+ * apart from them, and every lock has a cache line of its own so a writer
+ * does not invalidate the metadata or locks of neighbouring i-nodes.
  */
-typedef struct inode_t {    
+typedef struct inodeLock {
+	rwLock lock;
+	intentLock intent; /* for the subtree under the i-node */
+} __attribute__((aligned(CACHE_LINE_SIZE))) inodeLock;
+
+/*
+ * State an i-node had from snapshot generation from to generation to, kept
+ * while a snapshot of those generations may still read it. Directories keep
+ * a copy of their entries.
+ */
+typedef struct inodeVersion {
+	unsigned long from, to;
 	type nodeType;
-	union Data data;
-	pthread_rwlock_t lock;
-    /* more i-node attributes will be added in future exercises */
-} inode_t;
+	DirListing entries;
+	struct inodeVersion *older;
+} inodeVersion;
+
+typedef struct inodeChunk {
+	unsigned char nodeType[INODE_CHUNK_SIZE];
+	unsigned int version[INODE_CHUNK_SIZE]; /* bumped on every create and delete */
+	unsigned int seq[INODE_CHUNK_SIZE]; /* odd while the i-node is being written */
+	union Data data[INODE_CHUNK_SIZE];
+	unsigned long generation[INODE_CHUNK_SIZE]; /* snapshot generation the state was set in */
+	inodeVersion *versions[INODE_CHUNK_SIZE]; /* earlier states, newest first */
+	unsigned int pathSeq[INODE_CHUNK_SIZE]; /* odd while the i-node is being removed from a directory */
+	unsigned long entrySeq[INODE_CHUNK_SIZE]; /* entries added to the directory: started << 32 | finished */
+	int nextFree[INODE_CHUNK_SIZE]; /* next free inumber while the i-node is in the free list */
+#ifndef LOCK_STRIPING
+	inodeLock locks[INODE_CHUNK_SIZE];
+#endif
+	/* more i-node attributes will be added in future exercises */
+} inodeChunk;
 
 
 void insert_delay(int cycles);
@@ -53,18 +113,39 @@ int inode_create(type nType);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
 int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+int dir_reset_entry(int inumber, int sub_inumber, const char *sub_name, int len, unsigned int hash);
+int dir_add_entry(int inumber, int sub_inumber, const char *sub_name, int len, unsigned int hash);
+int dir_needs_rebuild(int inumber);
+void dir_rebuild(int inumber);
+void inode_print_tree(FILE *fp, int inumber, char *name, unsigned long snapshot);
+int inode_table_capacity();
+unsigned int inode_version(int inumber);
+unsigned int inode_path_seq(int inumber);
+unsigned long inode_entry_seq(int inumber);
+int inode_read_begin(int inumber, unsigned int *seq);
+int inode_read_validate(int inumber, unsigned int seq);
+int dir_lookup_optimistic(int inumber, unsigned int seq, const char *sub_name, int len, unsigned int hash);
+void inode_alloc_print_stats(FILE *fp);
+void inode_lock_print_stats(FILE *fp);
+void inode_update_begin();
+void inode_update_end();
+unsigned long inode_snapshot_take();
+void inode_snapshot_release(unsigned long snapshot);
+void inode_snapshot_print_stats(FILE *fp);
 
 /* Node lock related functions */
 
-void lockListAddRd(int inumber, pthread_rwlock_t **lockList);
-void lockListAddWr(int inumber, pthread_rwlock_t **lockList);
-void lockListSwitchToWr(int inumber, pthread_rwlock_t **lockList);
-void lockListClear(pthread_rwlock_t **lockList);
-void lockListUnlock(int inumber, pthread_rwlock_t** lockList);
-void printLock();
-void printUnlock();
+int lockListAddRd(int inumber);
+int lockListAddWr(int inumber);
+int lockListAddUp(int inumber);
+void lockListIntent(int inumber, int mode);
+int lockListTryIntent(int inumber, int mode);
+int lockListPromote(int inumber);
+int lockListUpgrade(int inumber);
+void lockListClear();
+int lockListCouple(int parent, int child, int mode, int *held);
+int lockListHas(int inumber);
+void lockListUnlock(int inumber);
+void printLockList();
 
 #endif /* INODES_H */
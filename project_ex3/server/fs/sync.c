@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sync.h"
+#include "state.h"
+#include "../lock.h"
+
+/* Names the strategies are chosen by, in syncStrategy order */
+static const char *sync_names[] = { "nosync", "mutex", "rwlock", "inode", "coupling", "optimistic" };
+
+syncStrategy sync_strategy = SYNC_OPTIMISTIC;
+
+/* Global locks of SYNC_MUTEX and SYNC_RWLOCK */
+pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+rwLock sync_rwlock;
+
+
+/*
+ * Chooses the synchronization strategy, before any operation runs.
+ * Input:
+ *  - name: one of sync_names, or NULL for SYNC_OPTIMISTIC
+ * Returns: SUCCESS or FAIL (unknown name)
+ */
+int sync_init(const char *name) {
+    lockInit(&sync_rwlock, LOCK_DEFAULT_FLAGS);
+    if (name == NULL) {
+        sync_strategy = SYNC_OPTIMISTIC;
+        return SUCCESS;
+    }
+    for (int i = SYNC_NONE; i <= SYNC_OPTIMISTIC; i++) {
+        if (strcmp(name, sync_names[i]) == 0) {
+            sync_strategy = i;
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+
+void sync_destroy() {
+    lockDestroy(&sync_rwlock);
+}
+
+
+const char *sync_name() {
+    return sync_names[sync_strategy];
+}
+
+
+/*
+ * Starts an operation that only reads the tree (SYNC_READ) or changes it
+ * (SYNC_WRITE), taking the global lock of the strategies that have one.
+ */
+void sync_enter(int mode) {
+    if (sync_strategy == SYNC_MUTEX)
+        pthread_mutex_lock(&sync_mutex);
+    else if (sync_strategy == SYNC_RWLOCK && mode == SYNC_WRITE)
+        lockwr(&sync_rwlock);
+    else if (sync_strategy == SYNC_RWLOCK)
+        lockrd(&sync_rwlock);
+}
+
+
+/* Ends an operation, releasing the global lock sync_enter took */
+void sync_exit() {
+    if (sync_strategy == SYNC_MUTEX)
+        pthread_mutex_unlock(&sync_mutex);
+    else if (sync_strategy == SYNC_RWLOCK)
+        unlock(&sync_rwlock);
+}
+
+
+/* Tells whether the strategy lets more than one worker thread run operations */
+int sync_multithreaded() {
+    return sync_strategy != SYNC_NONE;
+}
+
+
+/* Tells whether operations lock i-nodes */
+int sync_inode_locks() {
+    return sync_strategy >= SYNC_INODE;
+}
+
+
+/* Tells whether a lookup lets go of a directory once it has locked the next one */
+int sync_coupling() {
+    return sync_strategy >= SYNC_COUPLING;
+}
+
+
+/* Tells whether lookups and prints read without locks first */
+int sync_optimistic() {
+    return sync_strategy == SYNC_OPTIMISTIC;
+}
+
+
+/* Tells whether lookups may go straight to a path's last node through the dentry cache */
+int sync_path_cache() {
+    return sync_strategy != SYNC_INODE;
+}
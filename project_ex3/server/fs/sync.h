@@ -0,0 +1,34 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+/*
+ * Synchronization strategies the server can run with, chosen at startup:
+ *  - SYNC_NONE: no locks, for a single worker thread
+ *  - SYNC_MUTEX: one mutex around every operation
+ *  - SYNC_RWLOCK: one reader-writer lock, read locked by lookups and prints
+ *  - SYNC_INODE: i-node locks, every lock on the path held until the end
+ *  - SYNC_COUPLING: i-node locks with lock coupling
+ *  - SYNC_OPTIMISTIC: lock coupling, with lookups and prints reading
+ *    optimistically before they take locks (the default)
+ * Later strategies include what earlier ones in the list do with i-node locks.
+ */
+typedef enum syncStrategy {
+    SYNC_NONE, SYNC_MUTEX, SYNC_RWLOCK, SYNC_INODE, SYNC_COUPLING, SYNC_OPTIMISTIC
+} syncStrategy;
+
+/* sync_enter modes */
+#define SYNC_READ 0
+#define SYNC_WRITE 1
+
+int sync_init(const char *name);
+void sync_destroy();
+const char *sync_name();
+void sync_enter(int mode);
+void sync_exit();
+int sync_multithreaded();
+int sync_inode_locks();
+int sync_coupling();
+int sync_optimistic();
+int sync_path_cache();
+
+#endif /* SYNC_H */
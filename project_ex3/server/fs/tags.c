@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include "tags.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TAGS_X86
+#endif
+
+/*
+ * Kernels that compare a group of name tags. Each is built for its own
+ * instruction set, and the one the CPU supports is chosen at startup, so
+ * the server runs the same binary on any x86 CPU, or on other machines
+ * with the scalar kernel only.
+ */
+
+#define LANES_LOW 0x0001000100010001ULL
+#define LANES_HIGH 0x8000800080008000ULL
+
+/* Bit per tag equal to 0 among the 4 tags of a word, in its low 4 bits */
+static unsigned int lanes_zero(uint64_t word) {
+    /* the high bit of a lane is set if any of its bits is, without carries into the next lane */
+    uint64_t set = ((word & ~LANES_HIGH) + ~LANES_HIGH) | word;
+    uint64_t zero = (~set & LANES_HIGH) >> 15;
+    /* gathers the bits at 0, 16, 32 and 48 into bits 45 to 48 */
+    return (zero * 0x0000200040008001ULL) >> 45 & 0xf;
+}
+
+
+/* Four tags at a time in a 64 bit word, for CPUs without SIMD */
+static unsigned int match_scalar(const unsigned short *tags, unsigned short tag, unsigned int *free) {
+    uint64_t probe = tag * LANES_LOW;
+    unsigned int match = 0, empty = 0;
+
+    for (int i = 0; i < TAG_GROUP / 4; i++) {
+        const unsigned short *lane = tags + 4 * i;
+        uint64_t word = lane[0] | (uint32_t) lane[1] << 16 | (uint64_t) lane[2] << 32 | (uint64_t) lane[3] << 48;
+        match |= lanes_zero(word ^ probe) << (4 * i);
+        empty |= lanes_zero(word) << (4 * i);
+    }
+    *free = empty;
+    return match;
+}
+
+
+#ifdef TAGS_X86
+/* Two halves of 8 tags, each comparison narrowed to a byte per tag for one mask */
+__attribute__((target("sse2")))
+static unsigned int match_sse2(const unsigned short *tags, unsigned short tag, unsigned int *free) {
+    __m128i lo = _mm_loadu_si128((const __m128i *) tags);
+    __m128i hi = _mm_loadu_si128((const __m128i *) (tags + 8));
+    __m128i probe = _mm_set1_epi16((short) tag);
+    __m128i zero = _mm_setzero_si128();
+
+    *free = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(lo, zero), _mm_cmpeq_epi16(hi, zero)));
+    return _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(lo, probe), _mm_cmpeq_epi16(hi, probe)));
+}
+
+
+/*
+ * One load for the 16 tags. Packing the two comparisons interleaves them by
+ * 128 bit lane: the mask holds matches 0-7, free 0-7, matches 8-15, free 8-15.
+ */
+__attribute__((target("avx2")))
+static unsigned int match_avx2(const unsigned short *tags, unsigned short tag, unsigned int *free) {
+    __m256i group = _mm256_loadu_si256((const __m256i *) tags);
+    __m256i match = _mm256_cmpeq_epi16(group, _mm256_set1_epi16((short) tag));
+    __m256i empty = _mm256_cmpeq_epi16(group, _mm256_setzero_si256());
+    unsigned int mask = _mm256_movemask_epi8(_mm256_packs_epi16(match, empty));
+
+    *free = ((mask >> 8) & 0xff) | ((mask >> 16) & 0xff00);
+    return (mask & 0xff) | ((mask >> 8) & 0xff00);
+}
+#endif
+
+
+unsigned int (*tags_match)(const unsigned short *tags, unsigned short tag, unsigned int *free) = match_scalar;
+static const char *kernel = "scalar";
+
+
+/*
+ * Chooses the kernel for the CPU the server runs on. Must be called before
+ * any directory is used.
+ */
+void tags_init() {
+#ifdef TAGS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        tags_match = match_avx2;
+        kernel = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        tags_match = match_sse2;
+        kernel = "sse2";
+    }
+#endif
+}
+
+
+/* Returns the name of the kernel in use */
+const char *tags_kernel() {
+    return kernel;
+}
@@ -0,0 +1,28 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+/*
+ * 16 bit tag of a name: the top 9 bits of its hash over its length, which
+ * is always between 1 and MAX_FILE_NAME - 1. Tables keep the tags of their
+ * entries packed apart from the entries, so a lookup compares TAG_GROUP of
+ * them at once and only reads the entries whose tag matches.
+ */
+#define NAME_TAG(hash, len) ((unsigned short) ((((hash) >> 23) << 7) | (len)))
+/* Tag of a slot that ends a probe sequence, which no name has */
+#define TAG_FREE 0
+/* Tag of a removed entry, which no name has either, its length being 127 */
+#define TAG_DELETED 0xffff
+
+/* Tags compared at once, a table is read TAG_GROUP tags at a time */
+#define TAG_GROUP 16
+#define TAG_GROUPS(n) (((n) + TAG_GROUP - 1) / TAG_GROUP * TAG_GROUP)
+
+void tags_init();
+const char *tags_kernel();
+/*
+ * Compares TAG_GROUP tags with tag, the SIMD way the CPU supports.
+ * Returns: a bit per tag equal to tag, with a bit per TAG_FREE tag in *free
+ */
+extern unsigned int (*tags_match)(const unsigned short *tags, unsigned short tag, unsigned int *free);
+
+#endif /* TAGS_H */
@@ -1,53 +1,712 @@
 #include "lock.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
+/*
+ * Reader slots of one thread. Only the owner writes them, so announcing a
+ * read stays in the thread's own cache lines; writers scan the slot a lock
+ * hashes to in every row. depth counts reads of the same lock nested in the
+ * thread, which must not go to the underlying lock while a writer waits.
+ */
+typedef struct readerRow {
+    rwLock *slots[LOCK_READER_SLOTS];
+    int depth[LOCK_READER_SLOTS];
+    long biasedReads, lockedReads, revocations;
+    struct readerRow *next; /* all rows, so writers can scan them */
+} __attribute__((aligned(64))) readerRow;
 
-/*Read locks the given node lock.*/
-void lockrd(pthread_rwlock_t *lock)
+readerRow *reader_rows = NULL; /* pushed under rows_mutex, read without it */
+pthread_mutex_t rows_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread readerRow *thread_row = NULL;
+
+/* Locks are cache line aligned, so consecutive locks get consecutive slots */
+#define READER_SLOT(lock) (((unsigned long) (lock) / 64) & (LOCK_READER_SLOTS - 1))
+
+
+/*Returns the calling thread's reader slots, registering them on first use.*/
+static readerRow *reader_row()
 {
+    if (thread_row != NULL)
+        return thread_row;
 
-    if (pthread_rwlock_rdlock(lock) != 0)
+    readerRow *row;
+    if (posix_memalign((void **) &row, 64, sizeof(readerRow)) != 0)
     {
-        fprintf(stderr, "Error: failed to lock (read) rwlock.\n");
+        fprintf(stderr, "Error: failed to allocate reader slots.\n");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < LOCK_READER_SLOTS; i++)
+    {
+        row->slots[i] = NULL;
+        row->depth[i] = 0;
+    }
+    row->biasedReads = row->lockedReads = row->revocations = 0;
+
+    pthread_mutex_lock(&rows_mutex);
+    row->next = reader_rows;
+    __atomic_store_n(&reader_rows, row, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rows_mutex);
+
+    thread_row = row;
+    return row;
 }
 
-/*Write locks the given node lock.*/
-void lockwr(pthread_rwlock_t *lock)
+
+/*Initializes a lock; LOCK_PREFER_BIAS makes it biased from the start and quicker to become biased again.*/
+void lockInit(rwLock *lock, int flags)
+{
+    lock->state = lock->handoff = 0;
+    lock->readerSeq = lock->writerSeq = 0;
+    lock->readersWaiting = lock->writersWaiting = 0;
+    lock->spin = LOCK_SPIN_INITIAL;
+    lock->flags = (flags & LOCK_PREFER_BIAS) ? flags | LOCK_BIASED : flags;
+    lock->reads = 0;
+    lock->upgradeSeq = 0;
+    lock->acquisitions = lock->contended = lock->waitNs = 0;
+}
+
+
+void lockDestroy(rwLock *lock)
 {
-    if (pthread_rwlock_wrlock(lock) != 0)
+    if (lock->state != 0)
     {
-        fprintf(stderr, "Error: failed to lock (write) rwlock.\n");
+        fprintf(stderr, "Error: destroying a held lock.\n");
         exit(EXIT_FAILURE);
     }
 }
 
 
-/*Unlocks the given node lock.*/
-void unlock(pthread_rwlock_t *lock)
+static long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*Parks on a futex word while it holds seq, for at most timeoutNs if it is positive.*/
+static void futexWait(unsigned int *word, unsigned int seq, long timeoutNs)
+{
+    struct timespec timeout = { timeoutNs / 1000000000L, timeoutNs % 1000000000L };
+    /* EAGAIN (word changed), EINTR and ETIMEDOUT all just mean: look again */
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seq, timeoutNs > 0 ? &timeout : NULL, NULL, 0);
+}
+
+
+/*Bumps a futex word and wakes up to n of the threads parked on it.*/
+static void futexWake(unsigned int *word, int n)
+{
+    __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+
+/*Accounts for an acquisition that found the lock busy at start, spun spun times and parked if parked.*/
+static void lockContended(rwLock *lock, long start, int spun, int parked)
 {
-    if (pthread_rwlock_unlock(lock) != 0)
+    int spin = __atomic_load_n(&lock->spin, __ATOMIC_RELAXED);
+
+    /* spin longer for locks that are usually released while spinning, shorter otherwise */
+    if (parked)
+        spin -= spin / 8;
+    else
+        spin += (2 * spun - spin) / 8;
+    spin = spin < LOCK_SPIN_MIN ? LOCK_SPIN_MIN : spin > LOCK_SPIN_MAX ? LOCK_SPIN_MAX : spin;
+    __atomic_store_n(&lock->spin, spin, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&lock->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lock->waitNs, nowNs() - start, __ATOMIC_RELAXED);
+}
+
+
+/*Tells whether a reader may take a lock whose state is s, deferring to waiting writers deferrals more times.*/
+static int lockReadable(rwLock *lock, unsigned int s, int deferrals)
+{
+    if (s & (LOCK_WRITER | LOCK_UPGRADING))
+        return 0;
+    return deferrals == 0 || !(__atomic_load_n(&lock->flags, __ATOMIC_RELAXED) & LOCK_PREFER_WRITER)
+        || __atomic_load_n(&lock->writersWaiting, __ATOMIC_SEQ_CST) == 0;
+}
+
+
+/*Takes the lock in read mode if its state allows it. Returns: 1 on success.*/
+static int lockTryReadState(rwLock *lock, int deferrals)
+{
+    unsigned int s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+    while (lockReadable(lock, s, deferrals))
     {
-        fprintf(stderr, "Error: failed to unlock rwlock.\n");
-        exit(EXIT_FAILURE);
+        if (__atomic_compare_exchange_n(&lock->state, &s, s + LOCK_READER, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
     }
+    return 0;
 }
 
-void printLockList(pthread_rwlock_t **lockList)
+
+/*Takes a free lock in write mode, or the lock a releasing thread handed over. Returns: 1 on success.*/
+static int lockTryWriteState(rwLock *lock, int waiting)
 {
-    int i;
-    for(i = 0; i < 50; i++)
+    unsigned int s = 0;
+
+    if (waiting && __atomic_load_n(&lock->handoff, __ATOMIC_SEQ_CST) == 1)
     {
-        if(lockList[i] == NULL)
+        unsigned int one = 1;
+        if (__atomic_compare_exchange_n(&lock->handoff, &one, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return __atomic_compare_exchange_n(&lock->state, &s, LOCK_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+/*Read locks through the futex lock, spinning and then parking while it is taken.*/
+static void lockReadSlow(rwLock *lock)
+{
+    int deferrals = LOCK_READER_DEFERRALS, spun = 0, parked = 0;
+    long start;
+
+    __atomic_fetch_add(&lock->acquisitions, 1, __ATOMIC_RELAXED);
+    if (lockTryReadState(lock, deferrals))
+        return;
+
+    start = nowNs();
+    for (int limit = __atomic_load_n(&lock->spin, __ATOMIC_RELAXED); spun < limit; spun++)
+    {
+        cpu_relax();
+        if (lockTryReadState(lock, deferrals))
+        {
+            lockContended(lock, start, spun, 0);
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        unsigned int seq = __atomic_load_n(&lock->readerSeq, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&lock->readersWaiting, 1, __ATOMIC_SEQ_CST);
+        unsigned int s = __atomic_load_n(&lock->state, __ATOMIC_SEQ_CST);
+        if (!lockReadable(lock, s, deferrals))
         {
-            printf("#%d| 0 |\n", i);
+            /* held back only by waiting writers: park for a bounded time */
+            int deferring = !(s & (LOCK_WRITER | LOCK_UPGRADING));
+            futexWait(&lock->readerSeq, seq, deferring ? LOCK_DEFER_TIMEOUT_NS : 0);
+            deferrals -= deferring;
+            parked = 1;
         }
+        __atomic_fetch_sub(&lock->readersWaiting, 1, __ATOMIC_SEQ_CST);
+        if (lockTryReadState(lock, deferrals))
+            break;
+    }
+    lockContended(lock, start, spun, parked);
+}
+
+
+/*Lets readers into a lock the caller holds in write mode, keeping it in upgradable mode.*/
+static void lockDowngrade(rwLock *lock)
+{
+    __atomic_store_n(&lock->state, LOCK_UPGRADER, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->readersWaiting, __ATOMIC_SEQ_CST) > 0)
+        futexWake(&lock->readerSeq, INT_MAX);
+}
+
+
+/*Takes the lock in upgradable mode unless a writer or upgrader has it, or the lock a releasing thread handed over. Returns: 1 on success.*/
+static int lockTryUpgradableState(rwLock *lock, int waiting)
+{
+    unsigned int s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+    if (waiting && lockTryWriteState(lock, 1))
+    {
+        lockDowngrade(lock);
+        return 1;
+    }
+    while (!(s & (LOCK_WRITER | LOCK_UPGRADER)))
+    {
+        if (__atomic_compare_exchange_n(&lock->state, &s, s | LOCK_UPGRADER, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*Write locks, or with upgradable set takes in upgradable mode, spinning and then parking among the writers.*/
+static void lockExclusiveSlow(rwLock *lock, int upgradable)
+{
+    int spun = 0;
+    long start;
+
+    __atomic_fetch_add(&lock->acquisitions, 1, __ATOMIC_RELAXED);
+    if (upgradable ? lockTryUpgradableState(lock, 0) : lockTryWriteState(lock, 0))
+        return;
+
+    start = nowNs();
+    for (int limit = __atomic_load_n(&lock->spin, __ATOMIC_RELAXED); spun < limit; spun++)
+    {
+        cpu_relax();
+        if (upgradable ? lockTryUpgradableState(lock, 0) : lockTryWriteState(lock, 0))
+        {
+            lockContended(lock, start, spun, 0);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&lock->writersWaiting, 1, __ATOMIC_SEQ_CST);
+    for (;;)
+    {
+        unsigned int seq = __atomic_load_n(&lock->writerSeq, __ATOMIC_SEQ_CST);
+        if (upgradable ? lockTryUpgradableState(lock, 1) : lockTryWriteState(lock, 1))
+            break;
+        futexWait(&lock->writerSeq, seq, 0);
+    }
+    __atomic_fetch_sub(&lock->writersWaiting, 1, __ATOMIC_SEQ_CST);
+    lockContended(lock, start, spun, 1);
+}
+
+
+/*Gives a lock the caller holds in write mode to a waiting writer, which must exist.*/
+static void lockHandOff(rwLock *lock)
+{
+    __atomic_store_n(&lock->handoff, 1, __ATOMIC_SEQ_CST);
+    futexWake(&lock->writerSeq, 1);
+}
+
+
+/*Releases a read lock; the last reader out lets a waiting upgrade through or hands the lock to a waiting writer.*/
+static void lockReadRelease(rwLock *lock)
+{
+    unsigned int s = __atomic_sub_fetch(&lock->state, LOCK_READER, __ATOMIC_SEQ_CST);
+    unsigned int free = 0;
+
+    if (s == (LOCK_UPGRADER | LOCK_UPGRADING))
+        futexWake(&lock->upgradeSeq, 1);
+    else if (s == 0 && __atomic_load_n(&lock->writersWaiting, __ATOMIC_SEQ_CST) > 0
+            && __atomic_compare_exchange_n(&lock->state, &free, LOCK_WRITER, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        lockHandOff(lock);
+}
+
+
+/*Releases a write lock, handing it to the next writer when writers are preferred or no reader waits.*/
+static void lockWriteRelease(rwLock *lock)
+{
+    if (__atomic_load_n(&lock->writersWaiting, __ATOMIC_SEQ_CST) > 0
+            && ((__atomic_load_n(&lock->flags, __ATOMIC_RELAXED) & LOCK_PREFER_WRITER) || __atomic_load_n(&lock->readersWaiting, __ATOMIC_SEQ_CST) == 0))
+    {
+        lockHandOff(lock);
+        return;
+    }
+    __atomic_store_n(&lock->state, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->readersWaiting, __ATOMIC_SEQ_CST) > 0)
+        futexWake(&lock->readerSeq, INT_MAX);
+    if (__atomic_load_n(&lock->writersWaiting, __ATOMIC_SEQ_CST) > 0)
+        futexWake(&lock->writerSeq, 1);
+}
+
+
+/*Tries to read lock through the calling thread's slot. Returns: 1 if the lock was taken that way.*/
+static int lockReadBiased(rwLock *lock)
+{
+    readerRow *row = reader_row();
+    int i = READER_SLOT(lock);
+
+    if (row->slots[i] == lock)
+    {
+        /* nested read, the writer is already waiting for this slot */
+        row->depth[i]++;
+        row->biasedReads++;
+        return 1;
+    }
+    if (row->slots[i] != NULL || !(__atomic_load_n(&lock->flags, __ATOMIC_RELAXED) & LOCK_BIASED))
+        return 0;
+
+    __atomic_store_n(&row->slots[i], lock, __ATOMIC_RELAXED);
+    /* pairs with the fence of a revoking writer: either it sees the slot or we see the bias cleared */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->flags, __ATOMIC_RELAXED) & LOCK_BIASED)
+    {
+        row->depth[i] = 1;
+        row->biasedReads++;
+        return 1;
+    }
+    __atomic_store_n(&row->slots[i], NULL, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*Counts a read through the underlying lock, held by the caller, and biases the lock once it is hot.*/
+static void lockReadCounted(rwLock *lock)
+{
+    int flags = __atomic_load_n(&lock->flags, __ATOMIC_RELAXED);
+    int hot = (flags & LOCK_PREFER_BIAS) ? LOCK_HOT_READS_PREFERRED : LOCK_HOT_READS;
+
+    reader_row()->lockedReads++;
+    /* writers only change the flags while holding the lock in write mode */
+    if (!(flags & LOCK_BIASED) && __atomic_add_fetch(&lock->reads, 1, __ATOMIC_RELAXED) >= hot)
+        __atomic_fetch_or(&lock->flags, LOCK_BIASED, __ATOMIC_RELAXED);
+}
+
+
+/*Clears the bias of a lock the caller holds in write mode, and waits for the readers announced until then. Returns: 1 if one is still in and wait is 0, with the bias set again.*/
+static int lockRevoke(rwLock *lock, int wait)
+{
+    __atomic_store_n(&lock->reads, 0, __ATOMIC_RELAXED);
+    if (!(__atomic_load_n(&lock->flags, __ATOMIC_RELAXED) & LOCK_BIASED))
+        return 0;
+
+    __atomic_fetch_and(&lock->flags, ~LOCK_BIASED, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    reader_row()->revocations++;
+
+    /* new readers now queue on the underlying lock */
+    int i = READER_SLOT(lock);
+    for (readerRow *row = __atomic_load_n(&reader_rows, __ATOMIC_ACQUIRE); row != NULL; row = row->next)
+    {
+        while (__atomic_load_n(&row->slots[i], __ATOMIC_ACQUIRE) == lock)
+        {
+            if (!wait)
+            {
+                /* the bias is what makes the next writer wait for this reader */
+                __atomic_fetch_or(&lock->flags, LOCK_BIASED, __ATOMIC_RELAXED);
+                return 1;
+            }
+            sched_yield();
+        }
+    }
+    return 0;
+}
+
+
+/*Read locks the given node lock.*/
+void lockrd(rwLock *lock)
+{
+    if (lockReadBiased(lock))
+        return;
+    lockReadSlow(lock);
+    lockReadCounted(lock);
+}
+
+/*Write locks the given node lock.*/
+void lockwr(rwLock *lock)
+{
+    lockExclusiveSlow(lock, 0);
+    lockRevoke(lock, 1);
+}
+
+
+/*Read locks the given node lock if it can be done without waiting. Returns: 0 or EBUSY.*/
+int lockTryRd(rwLock *lock)
+{
+    if (lockReadBiased(lock))
+        return 0;
+    if (!lockTryReadState(lock, LOCK_READER_DEFERRALS))
+        return EBUSY;
+    __atomic_fetch_add(&lock->acquisitions, 1, __ATOMIC_RELAXED);
+    lockReadCounted(lock);
+    return 0;
+}
+
+
+/*Write locks the given node lock if it can be done without waiting. Returns: 0 or EBUSY.*/
+int lockTryWr(rwLock *lock)
+{
+    if (!lockTryWriteState(lock, 0))
+        return EBUSY;
+    __atomic_fetch_add(&lock->acquisitions, 1, __ATOMIC_RELAXED);
+    if (lockRevoke(lock, 0))
+    {
+        /* biased readers are still in */
+        lockWriteRelease(lock);
+        return EBUSY;
+    }
+    return 0;
+}
+
+
+/*Locks the given node lock in upgradable mode.*/
+void lockUpgradable(rwLock *lock)
+{
+    lockExclusiveSlow(lock, 1);
+}
+
+
+/*Locks the given node lock in upgradable mode if it can be done without waiting. Returns: 0 or EBUSY.*/
+int lockTryUpgradable(rwLock *lock)
+{
+    if (!lockTryUpgradableState(lock, 0))
+        return EBUSY;
+    __atomic_fetch_add(&lock->acquisitions, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/*Turns a read lock the caller holds into an upgradable one without letting go of it. Returns: 0, or EBUSY with the read lock still held.*/
+int lockTryPromote(rwLock *lock)
+{
+    readerRow *row = reader_row();
+    int i = READER_SLOT(lock);
+
+    if (row->slots[i] == lock)
+    {
+        /* the slot keeps writers out until the upgradable mode is taken */
+        if (row->depth[i] > 1 || !lockTryUpgradableState(lock, 0))
+            return EBUSY;
+        row->depth[i] = 0;
+        __atomic_store_n(&row->slots[i], NULL, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    unsigned int s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    while (!(s & LOCK_UPGRADER))
+    {
+        if (__atomic_compare_exchange_n(&lock->state, &s, s - LOCK_READER + LOCK_UPGRADER, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+    }
+    return EBUSY;
+}
+
+
+/*Upgrades the given node lock, held in upgradable mode, to write mode once the readers in it have left.*/
+void lockUpgrade(rwLock *lock)
+{
+    unsigned int ready = LOCK_UPGRADER | LOCK_UPGRADING;
+    int spun = 0, parked = 0;
+    long start = 0;
+
+    /* from here on, new readers wait */
+    __atomic_fetch_or(&lock->state, LOCK_UPGRADING, __ATOMIC_SEQ_CST);
+    for (int limit = __atomic_load_n(&lock->spin, __ATOMIC_RELAXED); ; spun++)
+    {
+        unsigned int seq = __atomic_load_n(&lock->upgradeSeq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&lock->state, __ATOMIC_SEQ_CST) == ready)
+            break;
+        if (start == 0)
+            start = nowNs();
+        if (spun < limit)
+            cpu_relax();
         else
         {
-            printf("#%d| 1 |\n", i);
+            futexWait(&lock->upgradeSeq, seq, 0);
+            parked = 1;
         }
     }
-}
\ No newline at end of file
+    __atomic_store_n(&lock->state, LOCK_WRITER, __ATOMIC_SEQ_CST);
+    if (start != 0)
+        lockContended(lock, start, spun, parked);
+    lockRevoke(lock, 1);
+}
+
+
+/*Upgrades the given node lock to write mode if no reader holds it. Returns: 0, or EBUSY with the lock still upgradable.*/
+int lockTryUpgrade(rwLock *lock)
+{
+    unsigned int s = LOCK_UPGRADER;
+
+    if (!__atomic_compare_exchange_n(&lock->state, &s, LOCK_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return EBUSY;
+    if (lockRevoke(lock, 0))
+    {
+        /* biased readers are still in */
+        lockDowngrade(lock);
+        return EBUSY;
+    }
+    return 0;
+}
+
+
+/*Unlocks the given node lock, held in upgradable mode and not upgraded, handing it over like the last reader would.*/
+void unlockUpgradable(rwLock *lock)
+{
+    unsigned int s = __atomic_and_fetch(&lock->state, ~LOCK_UPGRADER, __ATOMIC_SEQ_CST);
+    unsigned int free = 0;
+
+    if (__atomic_load_n(&lock->writersWaiting, __ATOMIC_SEQ_CST) == 0)
+        return;
+    if (s == 0 && __atomic_compare_exchange_n(&lock->state, &free, LOCK_WRITER, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        lockHandOff(lock);
+    else
+        /* readers are still in, which only a waiting upgrader can join */
+        futexWake(&lock->writerSeq, INT_MAX);
+}
+
+
+/*Unlocks the given node lock.*/
+void unlock(rwLock *lock)
+{
+    readerRow *row = reader_row();
+    int i = READER_SLOT(lock);
+
+    if (row->slots[i] == lock)
+    {
+        if (--row->depth[i] == 0)
+            __atomic_store_n(&row->slots[i], NULL, __ATOMIC_RELEASE);
+        return;
+    }
+
+    /* only the holder unlocks, so the writer bit tells the mode it holds */
+    unsigned int s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (s == LOCK_WRITER)
+        lockWriteRelease(lock);
+    else if (s >= LOCK_READER)
+        lockReadRelease(lock);
+    else
+    {
+        fprintf(stderr, "Error: failed to unlock rwlock.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*Copies the counters of a lock.*/
+void lockStats(rwLock *lock, long *acquisitions, long *contended, long *waitNs)
+{
+    *acquisitions = __atomic_load_n(&lock->acquisitions, __ATOMIC_RELAXED);
+    *contended = __atomic_load_n(&lock->contended, __ATOMIC_RELAXED);
+    *waitNs = __atomic_load_n(&lock->waitNs, __ATOMIC_RELAXED);
+}
+
+/* Holders of one intentLock mode, and the one holder of a mode */
+#define INTENT_MASK(mode) (((1UL << INTENT_BITS) - 1) << ((mode) * INTENT_BITS))
+#define INTENT_ONE(mode) (1UL << ((mode) * INTENT_BITS))
+
+/* Holders each intentLock mode has to wait for */
+static const unsigned long intentConflicts[] = {
+    [INTENT_IS] = INTENT_MASK(INTENT_X),
+    [INTENT_IX] = INTENT_MASK(INTENT_S) | INTENT_MASK(INTENT_X),
+    [INTENT_S] = INTENT_MASK(INTENT_IX) | INTENT_MASK(INTENT_X),
+    [INTENT_X] = ~0UL,
+};
+
+
+void lockIntentInit(intentLock *lock)
+{
+    lock->state = 0;
+    lock->seq = 0;
+    lock->waiters = lock->exclusiveWaiting = 0;
+}
+
+
+void lockIntentDestroy(intentLock *lock)
+{
+    if (lock->state != 0)
+    {
+        fprintf(stderr, "Error: destroying a held intent lock.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*Takes an intent lock in the given mode if no holder conflicts with it, IX also deferring to waiting S and X deferrals more times. Returns: 1 on success.*/
+static int lockTryIntentState(intentLock *lock, int mode, int deferrals)
+{
+    unsigned long s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+    if (mode == INTENT_IX && deferrals > 0 && __atomic_load_n(&lock->exclusiveWaiting, __ATOMIC_SEQ_CST) > 0)
+        return 0;
+    while (!(s & intentConflicts[mode]))
+    {
+        if (__atomic_compare_exchange_n(&lock->state, &s, s + INTENT_ONE(mode), 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*Takes an intent lock in the given INTENT_* mode, spinning and then parking while a holder conflicts with it.*/
+void lockIntent(intentLock *lock, int mode)
+{
+    int deferrals = LOCK_READER_DEFERRALS;
+    int exclusive = mode == INTENT_S || mode == INTENT_X;
+
+    if (lockTryIntentState(lock, mode, deferrals))
+        return;
+    for (int spun = 0; spun < LOCK_SPIN_INITIAL; spun++)
+    {
+        cpu_relax();
+        if (lockTryIntentState(lock, mode, deferrals))
+            return;
+    }
+
+    if (exclusive)
+        __atomic_fetch_add(&lock->exclusiveWaiting, 1, __ATOMIC_SEQ_CST);
+    for (;;)
+    {
+        unsigned int seq = __atomic_load_n(&lock->seq, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&lock->waiters, 1, __ATOMIC_SEQ_CST);
+        unsigned long s = __atomic_load_n(&lock->state, __ATOMIC_SEQ_CST);
+        int deferring = !(s & intentConflicts[mode]);
+        if (!deferring || (mode == INTENT_IX && deferrals > 0))
+        {
+            /* held back only by waiting S and X: park for a bounded time */
+            futexWait(&lock->seq, seq, deferring ? LOCK_DEFER_TIMEOUT_NS : 0);
+            deferrals -= deferring;
+        }
+        __atomic_fetch_sub(&lock->waiters, 1, __ATOMIC_SEQ_CST);
+        if (lockTryIntentState(lock, mode, deferrals))
+            break;
+    }
+    if (exclusive)
+        __atomic_fetch_sub(&lock->exclusiveWaiting, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*Takes an intent lock in the given INTENT_* mode if no holder conflicts with it. Returns: 0 on success, EBUSY otherwise.*/
+int lockTryIntent(intentLock *lock, int mode)
+{
+    return lockTryIntentState(lock, mode, 0) ? 0 : EBUSY;
+}
+
+
+/*Releases an intent lock held in the given mode, waking whoever waits for it.*/
+void unlockIntent(intentLock *lock, int mode)
+{
+    unsigned long s = __atomic_fetch_sub(&lock->state, INTENT_ONE(mode), __ATOMIC_SEQ_CST);
+
+    if (!(s & INTENT_MASK(mode)))
+    {
+        fprintf(stderr, "Error: failed to unlock intent lock.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (__atomic_load_n(&lock->waiters, __ATOMIC_SEQ_CST) > 0)
+        futexWake(&lock->seq, INT_MAX);
+}
+
+/*Waits before an operation that has to retry, a bit longer after every attempt.*/
+void lockBackoff(int attempts)
+{
+    if (attempts < 4)
+    {
+        sched_yield();
+        return;
+    }
+    usleep(1 << (attempts < 14 ? attempts - 4 : 10));
+}
+
+/*Prints how many reads went through reader slots and how often writers revoked the bias.*/
+void lockPrintStats(FILE *fp)
+{
+    long biased = 0, locked = 0, revocations = 0;
+
+    pthread_mutex_lock(&rows_mutex);
+    for (readerRow *row = reader_rows; row != NULL; row = row->next)
+    {
+        biased += __atomic_load_n(&row->biasedReads, __ATOMIC_RELAXED);
+        locked += __atomic_load_n(&row->lockedReads, __ATOMIC_RELAXED);
+        revocations += __atomic_load_n(&row->revocations, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&rows_mutex);
+    fprintf(fp, "reader bias: %ld biased reads, %ld locked reads, %ld revocations\n",
+            biased, locked, revocations);
+}
@@ -1,13 +1,125 @@
 #ifndef LOCK_H
 #define LOCK_H
 
-#include <pthread.h>
+#include <stdio.h>
 
-void lockrd(pthread_rwlock_t *lock);
-void lockwr(pthread_rwlock_t *lock);
-void unlock(pthread_rwlock_t *lock);
+/* Reads in a row, without a write, after which a lock becomes reader biased */
+#define LOCK_HOT_READS 64
+/* The same for locks that prefer the bias, such as the root's */
+#define LOCK_HOT_READS_PREFERRED 4
+/* Reader slots of each thread, a power of two */
+#define LOCK_READER_SLOTS 64
 
-/* DEBUG */
-void printLockList(pthread_rwlock_t **lockList);
+/* Spins before a contended lock parks, adapted per lock between these bounds */
+#define LOCK_SPIN_MIN 16
+#define LOCK_SPIN_INITIAL 128
+#define LOCK_SPIN_MAX 2048
+/* Times a reader parks for waiting writers, and for how long, before it barges in */
+#define LOCK_READER_DEFERRALS 2
+#define LOCK_DEFER_TIMEOUT_NS 500000
+
+/* rwLock.flags */
+#define LOCK_BIASED 1
+#define LOCK_PREFER_BIAS 2
+#define LOCK_PREFER_WRITER 4
+
+/* Build with -DLOCK_WRITER_PREFERENCE to make new readers wait for waiting writers */
+#ifdef LOCK_WRITER_PREFERENCE
+#define LOCK_DEFAULT_FLAGS LOCK_PREFER_WRITER
+#else
+#define LOCK_DEFAULT_FLAGS 0
+#endif
+
+/* rwLock.state */
+#define LOCK_WRITER 1U
+#define LOCK_UPGRADER 2U  /* held in upgradable mode, alongside readers */
+#define LOCK_UPGRADING 4U /* the upgrader waits for the readers to leave */
+#define LOCK_READER 8U
+
+/*
+ * Reader-writer lock built on futexes. A contended acquire spins for a
+ * while, adapting to how long the lock is usually held, and then parks on
+ * the futex word of its kind of waiter. A writer that unlocks with writers
+ * waiting hands the lock over to one of them without releasing it, and so
+ * does the last reader to leave, so a woken writer never has to compete
+ * for the lock again. With LOCK_PREFER_WRITER, readers also hold back while
+ * writers wait, for a bounded time so nested reads cannot deadlock.
+ *
+ * One thread at a time may hold the lock in upgradable mode: it shares the
+ * lock with readers but excludes writers and other upgraders, so what it
+ * read stays valid when it upgrades to write mode without releasing the
+ * lock. New readers wait while an upgrade waits for the current ones.
+ * Waiting upgraders queue, and are handed the lock, like writers.
+ *
+ * On top of that, a BRAVO style reader bias. While a lock is biased, a
+ * reader does not touch it: it announces itself in a slot of its own
+ * thread and checks the bias is still set. A writer takes the lock, clears
+ * the bias and waits for the announced readers to leave. Reads that go
+ * through the lock count towards biasing it again, and every write starts
+ * the count over, so only read mostly locks pay for revocations.
+ */
+typedef struct rwLock {
+	unsigned int state;     /* LOCK_WRITER, or LOCK_READER times the readers plus upgrader bits */
+	unsigned int handoff;   /* 1 while a waiting writer is being given the lock */
+	unsigned int readerSeq; /* futex words, bumped to wake readers or writers */
+	unsigned int writerSeq;
+	int readersWaiting;
+	int writersWaiting;
+	int spin;               /* spins before parking */
+	int flags;
+	int reads;              /* reads through the lock since the last write */
+	unsigned int upgradeSeq; /* futex word of an upgrade waiting for readers */
+	long acquisitions;      /* acquisitions through the lock, biased reads excluded */
+	long contended;         /* of those, acquisitions that had to spin or park */
+	long waitNs;            /* time spent spinning and parked */
+} rwLock;
+
+void lockInit(rwLock *lock, int flags);
+void lockDestroy(rwLock *lock);
+void lockrd(rwLock *lock);
+void lockwr(rwLock *lock);
+int lockTryRd(rwLock *lock);
+int lockTryWr(rwLock *lock);
+void lockUpgradable(rwLock *lock);
+int lockTryUpgradable(rwLock *lock);
+int lockTryPromote(rwLock *lock);
+void lockUpgrade(rwLock *lock);
+int lockTryUpgrade(rwLock *lock);
+void unlock(rwLock *lock);
+void unlockUpgradable(rwLock *lock);
+void lockBackoff(int attempts);
+void lockPrintStats(FILE *fp);
+void lockStats(rwLock *lock, long *acquisitions, long *contended, long *waitNs);
+
+/* intentLock modes */
+#define INTENT_NONE -1
+#define INTENT_IS 0 /* something below is read */
+#define INTENT_IX 1 /* something below is changed */
+#define INTENT_S 2  /* the whole subtree is read */
+#define INTENT_X 3  /* the whole subtree is changed */
+/* Bits of intentLock.state counting the holders of each mode */
+#define INTENT_BITS 16
+
+/*
+ * Multiple granularity lock, for locking a subtree as a whole while its
+ * nodes keep rwLocks of their own. IS and IX are taken on every ancestor of
+ * what is read or changed, S and X on the root of a subtree read or
+ * changed at once. IS goes along with every mode but X, IX with IS and IX,
+ * S with IS and S, and X with nothing. New IX holders hold back while an S
+ * or X waits, for a bounded time like deferring readers, so a stream of
+ * writers below a subtree cannot keep it from being read as a whole.
+ */
+typedef struct intentLock {
+	unsigned long state;   /* holders of each mode, INTENT_BITS bits per mode */
+	unsigned int seq;      /* futex word, bumped on releases with waiters */
+	int waiters;
+	int exclusiveWaiting;  /* S and X waiting */
+} intentLock;
+
+void lockIntentInit(intentLock *lock);
+void lockIntentDestroy(intentLock *lock);
+void lockIntent(intentLock *lock, int mode);
+int lockTryIntent(intentLock *lock, int mode);
+void unlockIntent(intentLock *lock, int mode);
 
 #endif
\ No newline at end of file
@@ -8,6 +8,12 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include "fs/operations.h"
+#include "fs/slab.h"
+#include "fs/epoch.h"
+#include "fs/sync.h"
+#include "fs/dcache.h"
+#include "fs/dhash.h"
+#include "fs/tags.h"
 #include "lock.h"
 
 #define MAX_COMMANDS 10
@@ -28,13 +34,11 @@ void execThreads(int nThreads);
 char* receive_command(struct sockaddr_un *clientAddr, socklen_t clilen);
 void send_result(struct sockaddr_un *clientAddr, socklen_t clilen, int res);
 void close_socket(char* path);
-int printTree(char* path);
+int printTree(char* path, char* subtree);
+void printStats();
 
 void applyCommands(){
 
-    /* Lookup function requires it's own external list */
-    pthread_rwlock_t *lookupLocks[INODE_TABLE_SIZE] = {NULL};
-
     while(1) //Server doesn't end
     {
         struct sockaddr_un clientAddr;
@@ -57,7 +61,6 @@ void applyCommands(){
         }
 
         int searchResult;
-        int validPath;
         int r; /* Result to send to client */
         switch (token) {
             case 'c':
@@ -79,13 +82,12 @@ void applyCommands(){
                 }
                 break;
             case 'l': 
-                searchResult = lookup(name, lookupLocks);
-                
+                searchResult = lookup_unlocked(name);
+
                 if (searchResult >= 0)
                     printf("Search: %s found\n", name);
                 else
                     printf("Search: %s not found\n", name);
-                lockListClear(lookupLocks);
                 send_result(&clientAddr, clilen, searchResult);
                 break;
             case 'd':
@@ -96,22 +98,14 @@ void applyCommands(){
             case 'm':
                 /* For m, we need to use typeOrPath as a string */
                 printf("Move: %s to %s\n", name, typeOrPath);
-                validPath = lookup(name, lookupLocks); 
-                if (validPath < 0)
-                {
-                    printf("Error: origin pathname does not exist.\n");
-                    lockListClear(lookupLocks);
-                    r = FAIL;
-                    send_result(&clientAddr, clilen, r);
-                    break;
-                }
-                lockListClear(lookupLocks);
                 r = move(name, typeOrPath);
                 send_result(&clientAddr, clilen, r);
                 break;
             case 'p':
                 printf("Print: %s\n", name);
-                r = printTree(name);
+                printStats();
+                /* An optional second path prints that subtree alone, as it is at one point in time */
+                r = printTree(name, numTokens == 3 ? typeOrPath : NULL);
                 send_result(&clientAddr, clilen, r);
                 break;
             default: { /* error */
@@ -194,7 +188,7 @@ char* receive_command(struct sockaddr_un *clientAddr, socklen_t clilen)
     //Preventivo, caso o cliente nao tenha terminado a mensagem em '\0', 
     in_buffer[c]='\0';
 
-    command = malloc(sizeof(char) * strlen(in_buffer));
+    command = malloc(sizeof(char) * (strlen(in_buffer) + 1));
     strcpy(command, in_buffer);
     
     return command;
@@ -212,21 +206,22 @@ void send_result(struct sockaddr_un *clientAddr, socklen_t clilen, int res)
     }
 }
 
-/* Prints the tree to the selected path (server side) */
-int printTree(char* path)
+/* Prints the tree, or the subtree under the given path if not NULL, to the selected path (server side) */
+int printTree(char* path, char* subtree)
 {
-    printLock();
-
     //Creating output file
     FILE *out = fopen(path, "w");
     if(out == NULL) //Failed print case
     {
         fprintf(stderr, "Error: output file couldn't be created.\n");
-        printUnlock();
         return FAIL;
     }
 
-    print_tecnicofs_tree(out);
+    int r = SUCCESS;
+    if (subtree == NULL)
+        print_tecnicofs_tree(out);
+    else
+        r = print_tecnicofs_subtree(out, subtree);
 
     //Closing output file
     if(fclose(out) != 0)
@@ -235,8 +230,24 @@ int printTree(char* path)
         exit(EXIT_FAILURE);
     }
 
-    printUnlock();
-    return SUCCESS;
+    return r;
+}
+
+/* Prints the allocator, lock and cache counters to stderr, when built with PRINT_STATS */
+void printStats()
+{
+#ifdef PRINT_STATS
+    inode_alloc_print_stats(stderr);
+    slab_print_stats(stderr);
+    epoch_print_stats(stderr);
+    lockPrintStats(stderr);
+    inode_lock_print_stats(stderr);
+    inode_snapshot_print_stats(stderr);
+    dcache_print_stats(stderr);
+#ifdef DIR_GLOBAL_TABLE
+    dhash_print_stats(stderr);
+#endif
+#endif
 }
 
 /* Closes the socket with the given path */
@@ -251,9 +262,10 @@ int main(int argc, char* argv[])
 {
     /* Argument parsing */
     
-    if(argc != 3)
+    if(argc != 3 && argc != 4)
     {
         fprintf(stderr, "Error: number of given arguments incorrect.\n");
+        fprintf(stderr, "Usage: %s numthreads socketname [nosync|mutex|rwlock|inode|coupling|optimistic]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     
@@ -266,8 +278,22 @@ int main(int argc, char* argv[])
     
     numberThreads = atoi(argv[1]);
 
+    /* The synchronization strategy is optional, lock coupling with optimistic reads by default */
+    if(sync_init(argc == 4 ? argv[3] : NULL) == FAIL)
+    {
+        fprintf(stderr, "Error: unknown synchronization strategy %s.\n", argv[3]);
+        exit(EXIT_FAILURE);
+    }
+    if(!sync_multithreaded() && numberThreads != 1)
+    {
+        fprintf(stderr, "Error: %s only runs with one thread.\n", sync_name());
+        exit(EXIT_FAILURE);
+    }
+    printf("Synchronization strategy: %s\n", sync_name());
+
     /* init filesystem */
     init_fs();
+    printf("Name tags matched with: %s\n", tags_kernel());
 
     /* Init datagram socket */
     init_socket(argv[2]);
@@ -278,5 +304,6 @@ int main(int argc, char* argv[])
 
     /* release allocated memory */
     destroy_fs();
+    sync_destroy();
     exit(EXIT_SUCCESS);
 }